@@ -0,0 +1,380 @@
+#include "command_io.h"
+#include "hotel_manager.h"
+#include "partitioned_booking.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+struct BenchmarkConfig {
+    size_t event_count = 1'000'000;
+    size_t hotel_count = 1'000;
+    double zipf_exponent = 1.0;
+    size_t client_count = 100'000;
+    double repeat_ratio = 0.5;
+    double read_ratio = 0.2;
+    // About 9 days of bookings by default, so every window fills and expires.
+    double events_per_second = 1;
+    size_t max_threads = 4;
+    uint64_t seed = 42;
+};
+
+class ZipfGenerator {
+public:
+    ZipfGenerator(size_t n, double exponent) : cdf(n) {
+        double sum = 0;
+        for (size_t rank = 0; rank < n; ++rank) {
+            sum += 1.0 / pow(rank + 1, exponent);
+            cdf[rank] = sum;
+        }
+        for (auto& value : cdf)
+            value /= sum;
+    }
+
+    // std::*_distribution output is implementation-defined, so sampling is done
+    // by hand on top of mt19937_64 to keep workloads identical across toolchains.
+    size_t operator()(mt19937_64& rng) const {
+        const size_t rank = upper_bound(cdf.begin(), cdf.end(), Uniform(rng)) - cdf.begin();
+        return min(rank, cdf.size() - 1);
+    }
+
+    static double Uniform(mt19937_64& rng) {
+        return (rng() >> 11) * 0x1.0p-53;
+    }
+
+private:
+    vector<double> cdf;
+};
+
+struct Workload {
+    vector<string> hotels;
+    vector<Command> commands;
+    size_t query_count = 0;
+};
+
+// Booking times grow by exponential gaps averaging 1 / events_per_second; a
+// booking reuses one of the hotel's recent clients with probability
+// repeat_ratio, and CLIENTS/ROOMS queries target hotels by the same popularity.
+Workload GenerateWorkload(const BenchmarkConfig& config) {
+    mt19937_64 rng(config.seed);
+    ZipfGenerator zipf(config.hotel_count, config.zipf_exponent);
+
+    Workload workload;
+    for (size_t i = 0; i < config.hotel_count; ++i)
+        workload.hotels.push_back("hotel" + to_string(i));
+
+    const size_t RECENT_CLIENTS = 16;
+    vector<vector<int>> recent_clients(config.hotel_count);
+    double time = 0;
+
+    workload.commands.reserve(config.event_count);
+    for (size_t i = 0; i < config.event_count; ++i) {
+        Command command;
+        const size_t hotel = zipf(rng);
+        command.hotel = workload.hotels[hotel];
+
+        if (ZipfGenerator::Uniform(rng) < config.read_ratio) {
+            command.type = rng() % 2 ? CommandType::CLIENTS : CommandType::ROOMS;
+            ++workload.query_count;
+        } else {
+            time += -log(1 - ZipfGenerator::Uniform(rng)) / config.events_per_second;
+            command.type = CommandType::BOOK;
+            command.time = static_cast<int64_t>(time);
+            command.room_count = 1 + rng() % 4;
+
+            auto& recent = recent_clients[hotel];
+            if (!recent.empty() && ZipfGenerator::Uniform(rng) < config.repeat_ratio) {
+                command.client_id = recent[rng() % recent.size()];
+            } else {
+                command.client_id = rng() % config.client_count;
+                if (recent.size() < RECENT_CLIENTS)
+                    recent.push_back(command.client_id);
+                else
+                    recent[rng() % RECENT_CLIENTS] = command.client_id;
+            }
+        }
+
+        workload.commands.push_back(command);
+    }
+
+    return workload;
+}
+
+// Keeps every booking of the last window_length seconds per hotel one by
+// one, with a booking count per client, and drops the expired ones when the
+// hotel is queried.
+vector<uint64_t> ReferenceAnswers(const Workload& workload, int64_t window_length) {
+    struct Booking {
+        int64_t time;
+        int client_id;
+        int64_t room_count;
+    };
+    struct HotelBookings {
+        deque<Booking> bookings;
+        unordered_map<int, size_t> client_bookings;
+        int64_t rooms = 0;
+    };
+    unordered_map<string_view, HotelBookings> hotels;
+    int64_t now = 0;
+
+    vector<uint64_t> answers;
+    for (const Command& command : workload.commands) {
+        HotelBookings& hotel = hotels[command.hotel];
+
+        if (command.type == CommandType::BOOK) {
+            now = command.time;
+            hotel.bookings.push_back({command.time, command.client_id, command.room_count});
+            ++hotel.client_bookings[command.client_id];
+            hotel.rooms += command.room_count;
+            continue;
+        }
+
+        while (!hotel.bookings.empty() && hotel.bookings.front().time <= now - window_length) {
+            const Booking& booking = hotel.bookings.front();
+            if (--hotel.client_bookings[booking.client_id] == 0)
+                hotel.client_bookings.erase(booking.client_id);
+            hotel.rooms -= booking.room_count;
+            hotel.bookings.pop_front();
+        }
+
+        answers.push_back(command.type == CommandType::CLIENTS ? hotel.client_bookings.size() : hotel.rooms);
+    }
+
+    return answers;
+}
+
+void Report(const string& name, size_t threads, size_t items, steady_clock::duration elapsed,
+            vector<steady_clock::duration> latencies = {}) {
+    const double ms = duration<double, milli>(elapsed).count();
+    const double per_second = ms > 0 ? items * 1000.0 / ms : 0;
+
+    cout << "{\"benchmark\": \"" << name << "\""
+         << ", \"threads\": " << threads
+         << ", \"items\": " << items
+         << ", \"ms\": " << ms
+         << ", \"items_per_sec\": " << per_second;
+
+    if (!latencies.empty()) {
+        sort(latencies.begin(), latencies.end());
+        for (const auto& [label, quantile] : {pair{"p50", 0.5}, {"p99", 0.99}, {"p999", 0.999}, {"max", 1.0}}) {
+            const size_t index = min(latencies.size() - 1, static_cast<size_t>(quantile * latencies.size()));
+            cout << ", \"" << label << "_ns\": " << duration_cast<nanoseconds>(latencies[index]).count();
+        }
+    }
+
+    cout << "}" << endl;
+}
+
+void CheckAnswers(const string& name, const vector<uint64_t>& answers, const vector<uint64_t>& reference) {
+    if (answers != reference)
+        throw runtime_error(name + " disagrees with the brute-force reference");
+}
+
+// Runs the commands through one HotelManager, timing every operation, and
+// checks the answers of its first window.
+void BenchmarkManager(const string& name, HotelManager manager, const Workload& workload,
+                      const vector<uint64_t>& reference) {
+    vector<steady_clock::duration> latencies;
+    latencies.reserve(workload.commands.size());
+    vector<uint64_t> answers;
+    answers.reserve(workload.query_count);
+
+    const auto start = steady_clock::now();
+    for (const Command& command : workload.commands) {
+        const auto operation_start = steady_clock::now();
+        switch (command.type) {
+        case CommandType::BOOK:
+            manager.Book(command.time, command.hotel, command.client_id, command.room_count);
+            break;
+        case CommandType::CLIENTS:
+            answers.push_back(manager.GetClients(command.hotel));
+            break;
+        case CommandType::ROOMS:
+            answers.push_back(manager.GetRooms(command.hotel));
+            break;
+        case CommandType::UNKNOWN:
+            break;
+        }
+        latencies.push_back(steady_clock::now() - operation_start);
+    }
+    Report(name, 1, workload.commands.size(), steady_clock::now() - start, move(latencies));
+
+    CheckAnswers(name, answers, reference);
+}
+
+// Replays the commands untimed and checks the answers of every window against
+// the brute-force references. With history, about one query in 64 also asks
+// about a random moment of the past two weeks, for an hour, a day or a week,
+// checked by scanning the hotel's bookings.
+void CheckManager(const string& name, HotelManager manager, const Workload& workload,
+                  const vector<int64_t>& window_lengths, const map<int64_t, vector<uint64_t>>& references,
+                  bool check_history, uint64_t seed) {
+    const int64_t HISTORY_WINDOW_LENGTHS[] = {HotelManager::SECONDS_IN_HOUR, HotelManager::SECONDS_IN_DAY,
+                                              HotelManager::SECONDS_IN_WEEK};
+    struct Booking {
+        int64_t time;
+        int client_id;
+        int64_t room_count;
+    };
+    unordered_map<string_view, vector<Booking>> bookings;
+    mt19937_64 rng(seed);
+    int64_t now = 0;
+
+    vector<vector<uint64_t>> answers(window_lengths.size());
+    for (const Command& command : workload.commands) {
+        if (command.type == CommandType::BOOK) {
+            manager.Book(command.time, command.hotel, command.client_id, command.room_count);
+            if (check_history)
+                bookings[command.hotel].push_back({command.time, command.client_id, command.room_count});
+            now = command.time;
+            continue;
+        }
+        if (command.type == CommandType::UNKNOWN)
+            continue;
+
+        for (size_t window = 0; window < window_lengths.size(); ++window) {
+            answers[window].push_back(command.type == CommandType::CLIENTS
+                                      ? manager.GetClients(command.hotel, window)
+                                      : manager.GetRooms(command.hotel, window));
+        }
+
+        if (!check_history || rng() % 64 != 0)
+            continue;
+
+        const int64_t time = now - static_cast<int64_t>(rng() % (2 * HotelManager::SECONDS_IN_WEEK));
+        const int64_t window_length = HISTORY_WINDOW_LENGTHS[rng() % size(HISTORY_WINDOW_LENGTHS)];
+        const vector<Booking>& hotel = bookings[command.hotel];
+        const auto first = upper_bound(hotel.begin(), hotel.end(), time - window_length,
+                                       [](int64_t t, const Booking& booking) { return t < booking.time; });
+        const auto last = upper_bound(first, hotel.end(), time,
+                                      [](int64_t t, const Booking& booking) { return t < booking.time; });
+        unordered_set<int> clients;
+        int64_t rooms = 0;
+        for (auto it = first; it != last; ++it) {
+            clients.insert(it->client_id);
+            rooms += it->room_count;
+        }
+
+        if (manager.GetClientsAt(command.hotel, time, window_length) != clients.size()
+            || manager.GetRoomsAt(command.hotel, time, window_length) != rooms)
+            throw runtime_error(name + " history disagrees with the brute-force scan at time " + to_string(time));
+    }
+
+    for (size_t window = 0; window < window_lengths.size(); ++window)
+        CheckAnswers(name + " window " + to_string(window), answers[window], references.at(window_lengths[window]));
+}
+
+vector<uint64_t> ParseAnswers(FILE* file) {
+    vector<uint64_t> answers;
+    rewind(file);
+    for (unsigned long long answer; fscanf(file, "%llu", &answer) == 1;)
+        answers.push_back(answer);
+    return answers;
+}
+
+void BenchmarkPartitioned(const BenchmarkConfig& config, const Workload& workload, const vector<uint64_t>& reference) {
+    for (size_t threads = 2; threads <= config.max_threads; ++threads) {
+        FILE* output = tmpfile();
+        if (!output)
+            throw runtime_error("cannot create a temporary file for answers");
+
+        const auto start = steady_clock::now();
+        {
+            AnswerWriter writer(fileno(output));
+            PartitionedBookingProcessor processor(threads, writer);
+            for (const Command& command : workload.commands)
+                processor.Process(command);
+            processor.Finish();
+            writer.Flush();
+        }
+        Report("partitioned", threads, workload.commands.size(), steady_clock::now() - start);
+
+        const vector<uint64_t> answers = ParseAnswers(output);
+        fclose(output);
+        CheckAnswers("partitioned", answers, reference);
+    }
+}
+
+const string USAGE = "usage: booking_benchmark [--events N] [--hotels N] [--zipf S] [--clients N] [--repeat P] "
+                     "[--read-ratio P] [--rate R] [--threads N] [--seed N]";
+
+BenchmarkConfig ParseArguments(int argc, char* argv[]) {
+    BenchmarkConfig config;
+
+    if (argc % 2 == 0)
+        throw invalid_argument("option " + string(argv[argc - 1]) + " needs a value\n" + USAGE);
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const string_view name = argv[i];
+        const string value = argv[i + 1];
+
+        if (name == "--events")
+            config.event_count = stoul(value);
+        else if (name == "--hotels")
+            config.hotel_count = stoul(value);
+        else if (name == "--zipf")
+            config.zipf_exponent = stod(value);
+        else if (name == "--clients")
+            config.client_count = stoul(value);
+        else if (name == "--repeat")
+            config.repeat_ratio = stod(value);
+        else if (name == "--read-ratio")
+            config.read_ratio = stod(value);
+        else if (name == "--rate")
+            config.events_per_second = stod(value);
+        else if (name == "--threads")
+            config.max_threads = stoul(value);
+        else if (name == "--seed")
+            config.seed = stoull(value);
+        else
+            throw invalid_argument("unknown option " + string(name) + "\n" + USAGE);
+    }
+
+    if (config.hotel_count == 0 || config.client_count == 0 || config.events_per_second <= 0)
+        throw invalid_argument("--hotels, --clients and --rate must be positive");
+
+    return config;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        const BenchmarkConfig config = ParseArguments(argc, argv);
+        const Workload workload = GenerateWorkload(config);
+        const vector<int64_t> window_lengths = {HotelManager::SECONDS_IN_DAY, HotelManager::SECONDS_IN_HOUR,
+                                                HotelManager::SECONDS_IN_WEEK};
+        map<int64_t, vector<uint64_t>> references;
+        for (int64_t window_length : window_lengths)
+            references[window_length] = ReferenceAnswers(workload, window_length);
+        const vector<uint64_t>& reference = references[window_lengths[0]];
+
+        BenchmarkManager("sequential", HotelManager(), workload, reference);
+        BenchmarkManager("three_windows", HotelManager(window_lengths), workload, reference);
+        CheckManager("three_windows", HotelManager(window_lengths), workload, window_lengths, references, false,
+                     config.seed);
+        BenchmarkManager("with_history", HotelManager({HotelManager::SECONDS_IN_DAY}, true), workload, reference);
+        CheckManager("with_history", HotelManager({HotelManager::SECONDS_IN_DAY}, true), workload,
+                     {HotelManager::SECONDS_IN_DAY}, references, true, config.seed);
+        BenchmarkPartitioned(config, workload, reference);
+    } catch (exception& e) {
+        cerr << "benchmark failed: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
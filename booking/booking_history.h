@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Append-only store of every booking, kept per hotel in columns, answering
+// "rooms / distinct clients in the window (time - length, time]" for any past
+// time in O(log n).
+//
+// Rooms come from prefix sums over the booking times. For clients, booking i
+// of a hotel stores the position just after the same client's previous
+// booking there (0 if none); the bookings [l, r) then hold as many distinct
+// clients as positions i in [l, r) with that value <= l. A persistent segment
+// tree over the stored values, with one version per booking, counts them.
+// Every hotel keeps its tree nodes in an arena of its own, so 32-bit node
+// indices hold about 100M bookings per hotel; Add throws beyond that.
+class BookingHistory {
+public:
+    void Add(int64_t time, uint32_t hotel_id, int client_id, int64_t room_count) {
+        if (hotel_id >= hotels.size())
+            hotels.resize(hotel_id + 1);
+        HotelColumns& hotel = hotels[hotel_id];
+        if (hotel.nodes.size() > MAX_NODES - MAX_NODES_PER_BOOKING)
+            throw overflow_error("booking history of hotel " + to_string(hotel_id) + " is full");
+
+        const uint32_t position = hotel.times.size();
+        uint32_t& last_position = hotel.last_positions[client_id];
+        hotel.roots.push_back(AddVersion(hotel.nodes, hotel.roots.back(), DomainSize(position),
+                                         DomainSize(position + 1), last_position));
+        last_position = position + 1;
+
+        hotel.times.push_back(time);
+        hotel.room_prefix_sums.push_back(hotel.room_prefix_sums.back() + room_count);
+    }
+
+    uint64_t GetClients(uint32_t hotel_id, int64_t time, int64_t window_length) const {
+        if (hotel_id >= hotels.size())
+            return 0;
+        const HotelColumns& hotel = hotels[hotel_id];
+        const auto [first, last] = FindRange(hotel, time, window_length);
+
+        // Each of the first bookings stores a value below first, so all of
+        // them are counted too.
+        return CountAtMost(hotel.nodes, hotel.roots[last], DomainSize(last), first) - first;
+    }
+
+    int64_t GetRooms(uint32_t hotel_id, int64_t time, int64_t window_length) const {
+        if (hotel_id >= hotels.size())
+            return 0;
+        const HotelColumns& hotel = hotels[hotel_id];
+        const auto [first, last] = FindRange(hotel, time, window_length);
+        return hotel.room_prefix_sums[last] - hotel.room_prefix_sums[first];
+    }
+
+private:
+    struct Node {
+        uint32_t left = 0;
+        uint32_t right = 0;
+        uint32_t count = 0;
+    };
+
+    struct HotelColumns {
+        vector<int64_t> times;
+        vector<int64_t> room_prefix_sums = {0};
+        // Segment tree root of the first i bookings.
+        vector<uint32_t> roots = {0};
+        unordered_map<int, uint32_t> last_positions;
+        // Node 0 is the shared empty tree.
+        vector<Node> nodes = {Node()};
+    };
+
+    // A booking copies one root-to-leaf path of at most 33 nodes and may add
+    // one more root when the domain doubles.
+    static const uint32_t MAX_NODES = numeric_limits<uint32_t>::max();
+    static const uint32_t MAX_NODES_PER_BOOKING = 64;
+
+    vector<HotelColumns> hotels;
+
+    // The tree of the first n bookings covers values [0, DomainSize(n)). When
+    // the domain doubles, the old tree becomes the left half of the new one.
+    static uint32_t DomainSize(uint32_t booking_count) {
+        if (booking_count >= uint32_t(1) << 31)
+            throw overflow_error("too many bookings for the history domain");
+        uint32_t size = 1;
+        while (size <= booking_count)
+            size *= 2;
+        return size;
+    }
+
+    static pair<uint32_t, uint32_t> FindRange(const HotelColumns& hotel, int64_t time, int64_t window_length) {
+        const auto first = upper_bound(hotel.times.begin(), hotel.times.end(), time - window_length);
+        const auto last = upper_bound(first, hotel.times.end(), time);
+        return {static_cast<uint32_t>(first - hotel.times.begin()), static_cast<uint32_t>(last - hotel.times.begin())};
+    }
+
+    static uint32_t NewNode(vector<Node>& nodes, uint32_t left, uint32_t right) {
+        nodes.push_back({left, right, nodes[left].count + nodes[right].count});
+        return nodes.size() - 1;
+    }
+
+    static uint32_t AddVersion(vector<Node>& nodes, uint32_t root, uint32_t domain_size, uint32_t new_domain_size,
+                               uint32_t value) {
+        for (; domain_size < new_domain_size; domain_size *= 2)
+            root = NewNode(nodes, root, 0);
+        return Insert(nodes, root, 0, domain_size, value);
+    }
+
+    static uint32_t Insert(vector<Node>& nodes, uint32_t node, uint32_t first, uint32_t last, uint32_t value) {
+        if (last - first == 1) {
+            nodes.push_back({0, 0, nodes[node].count + 1});
+            return nodes.size() - 1;
+        }
+
+        const uint32_t middle = first + (last - first) / 2;
+        const Node copy = nodes[node];
+        if (value < middle)
+            return NewNode(nodes, Insert(nodes, copy.left, first, middle, value), copy.right);
+        return NewNode(nodes, copy.left, Insert(nodes, copy.right, middle, last, value));
+    }
+
+    static uint64_t CountAtMost(const vector<Node>& nodes, uint32_t node, uint32_t domain_size, uint32_t value) {
+        uint64_t result = 0;
+        for (uint32_t first = 0, last = domain_size; node != 0;) {
+            if (value >= last - 1)
+                return result + nodes[node].count;
+
+            const uint32_t middle = first + (last - first) / 2;
+            if (value < middle) {
+                node = nodes[node].left;
+                last = middle;
+            } else {
+                result += nodes[nodes[node].left].count;
+                node = nodes[node].right;
+                first = middle;
+            }
+        }
+        return result;
+    }
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+enum class CommandType {
+    BOOK,
+    CLIENTS,
+    ROOMS,
+    UNKNOWN,
+};
+
+struct Command {
+    CommandType type = CommandType::UNKNOWN;
+    int64_t time = 0;
+    string_view hotel;
+    int client_id = 0;
+    int64_t room_count = 0;
+};
+
+// Parses the command stream straight out of a file descriptor: a regular file
+// is mapped whole, anything else is read in large blocks. Command::hotel
+// points into the input and stays valid until the next call to Next.
+class CommandReader {
+public:
+    explicit CommandReader(int fd) : fd(fd) {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                mapping = static_cast<const char*>(data);
+                mapping_size = info.st_size;
+                madvise(data, mapping_size, MADV_SEQUENTIAL);
+                first = mapping;
+                last = mapping + mapping_size;
+                eof = true;
+            }
+        }
+        // Refill moves the unparsed tail to the front, so the buffer needs
+        // storage before the first read.
+        if (!mapping) {
+            buffer.resize(BLOCK_SIZE);
+            first = last = buffer.data();
+        }
+    }
+
+    CommandReader(const CommandReader&) = delete;
+    CommandReader& operator=(const CommandReader&) = delete;
+
+    ~CommandReader() {
+        if (mapping)
+            munmap(const_cast<char*>(mapping), mapping_size);
+    }
+
+    // The leading command count.
+    bool ReadCount(uint64_t& count) {
+        string_view line;
+        if (!NextLine(line))
+            return false;
+        count = ParseInt<uint64_t>(line);
+        return true;
+    }
+
+    bool Next(Command& command) {
+        string_view line;
+        do {
+            if (!NextLine(line))
+                return false;
+            SkipSpaces(line);
+        } while (line.empty());
+
+        const string_view verb = NextToken(line);
+        if (verb == "BOOK") {
+            command.type = CommandType::BOOK;
+            command.time = ParseInt<int64_t>(line);
+            command.hotel = NextToken(line);
+            command.client_id = ParseInt<int>(line);
+            command.room_count = ParseInt<int64_t>(line);
+        } else if (verb == "CLIENTS" || verb == "ROOMS") {
+            command.type = verb == "CLIENTS" ? CommandType::CLIENTS : CommandType::ROOMS;
+            command.hotel = NextToken(line);
+        } else {
+            command.type = CommandType::UNKNOWN;
+        }
+        return true;
+    }
+
+private:
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    int fd;
+    const char* mapping = nullptr;
+    size_t mapping_size = 0;
+    vector<char> buffer;
+    const char* first = nullptr;
+    const char* last = nullptr;
+    bool eof = false;
+
+    // Makes sure a whole line is in memory, moving a partial one to the front
+    // of the buffer before reading the next block.
+    bool NextLine(string_view& line) {
+        for (size_t scanned = 0;; ) {
+            const char* newline = static_cast<const char*>(memchr(first + scanned, '\n', last - first - scanned));
+            if (newline) {
+                line = {first, static_cast<size_t>(newline - first)};
+                first = newline + 1;
+                return true;
+            }
+            scanned = last - first;
+
+            if (eof) {
+                if (first == last)
+                    return false;
+                line = {first, static_cast<size_t>(last - first)};
+                first = last;
+                return true;
+            }
+            Refill();
+        }
+    }
+
+    void Refill() {
+        const size_t pending = last - first;
+        memmove(buffer.data(), first, pending);
+        if (buffer.size() < pending + BLOCK_SIZE)
+            buffer.resize(max(2 * buffer.size(), pending + BLOCK_SIZE));
+
+        ssize_t bytes_read;
+        do {
+            bytes_read = read(fd, buffer.data() + pending, buffer.size() - pending);
+        } while (bytes_read < 0 && errno == EINTR);
+        if (bytes_read < 0)
+            throw runtime_error("cannot read commands: " + string(strerror(errno)));
+
+        first = buffer.data();
+        last = buffer.data() + pending + bytes_read;
+        eof = bytes_read == 0;
+    }
+
+    static void SkipSpaces(string_view& line) {
+        while (!line.empty() && (line.front() == ' ' || line.front() == '\t' || line.front() == '\r'))
+            line.remove_prefix(1);
+    }
+
+    static string_view NextToken(string_view& line) {
+        SkipSpaces(line);
+        size_t length = 0;
+        while (length < line.size() && line[length] != ' ' && line[length] != '\t' && line[length] != '\r')
+            ++length;
+
+        const string_view token = line.substr(0, length);
+        line.remove_prefix(length);
+        return token;
+    }
+
+    // The next token must be a whole number that fits Int.
+    template <typename Int>
+    static Int ParseInt(string_view& line) {
+        const string_view token = NextToken(line);
+        Int value = 0;
+        const auto [token_end, error] = from_chars(token.data(), token.data() + token.size(), value);
+        if (error == errc::result_out_of_range)
+            throw out_of_range("number out of range: " + string(token));
+        if (error != errc() || token_end != token.data() + token.size())
+            throw invalid_argument("malformed number: \"" + string(token) + "\"");
+        return value;
+    }
+};
+
+// Collects answers in a buffer and writes it out in large chunks.
+class AnswerWriter {
+public:
+    explicit AnswerWriter(int fd) : fd(fd) {
+        buffer.reserve(BUFFER_SIZE);
+    }
+
+    AnswerWriter(const AnswerWriter&) = delete;
+    AnswerWriter& operator=(const AnswerWriter&) = delete;
+
+    // Errors cannot be reported from here; call Flush to see them.
+    ~AnswerWriter() {
+        try {
+            Flush();
+        } catch (exception&) {
+        }
+    }
+
+    void WriteLine(uint64_t value) {
+        char digits[24];
+        char* digits_end = to_chars(begin(digits), end(digits), value).ptr;
+        *digits_end++ = '\n';
+        buffer.append(digits, digits_end);
+
+        if (buffer.size() >= BUFFER_SIZE)
+            Flush();
+    }
+
+    // Throws if the answers cannot be written; the unwritten ones are dropped.
+    void Flush() {
+        for (size_t written = 0; written < buffer.size();) {
+            const ssize_t result = write(fd, buffer.data() + written, buffer.size() - written);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result < 0) {
+                const int error = errno;
+                buffer.clear();
+                throw runtime_error("cannot write answers: " + string(strerror(error)));
+            }
+            written += result;
+        }
+        buffer.clear();
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    int fd;
+    string buffer;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "booking_history.h"
+#include "sliding_window.h"
+#include "snapshot.h"
+
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+class HotelManager {
+public:
+    static const int64_t SECONDS_IN_HOUR = 3'600;
+    static const int64_t SECONDS_IN_DAY = 86'400;
+    static const int64_t SECONDS_IN_WEEK = 7 * SECONDS_IN_DAY;
+
+    // CLIENTS and ROOMS can be asked for each of the windows, all maintained
+    // in one pass over the bookings. With keep_history every booking is also
+    // stored for point-in-time queries.
+    explicit HotelManager(vector<int64_t> window_lengths = {SECONDS_IN_DAY}, bool keep_history = false)
+        : windows(move(window_lengths)) {
+        if (keep_history)
+            history.emplace();
+    }
+
+    void Book(int64_t time, string_view hotel, int client_id, int64_t room_count) {
+        const uint32_t hotel_id = InternHotel(hotel);
+        windows.Add(time, hotel_id, {client_id, room_count});
+        if (history)
+            history->Add(time, hotel_id, client_id, room_count);
+    }
+
+    // Expires bookings as of time without booking anything.
+    void Advance(int64_t time) {
+        windows.Advance(time);
+    }
+
+    uint64_t GetClients(string_view hotel, size_t window = 0) const {
+        const auto hotel_id = FindHotel(hotel);
+        return hotel_id ? windows.Get(window, *hotel_id).clients.Get() : 0;
+    }
+
+    uint64_t GetRooms(string_view hotel, size_t window = 0) const {
+        const auto hotel_id = FindHotel(hotel);
+        return hotel_id ? windows.Get(window, *hotel_id).rooms.Get() : 0;
+    }
+
+    // Distinct clients and rooms of the bookings in (time - window_length, time].
+    uint64_t GetClientsAt(string_view hotel, int64_t time, int64_t window_length = SECONDS_IN_DAY) const {
+        const auto hotel_id = FindHotel(hotel);
+        return hotel_id ? GetHistory().GetClients(*hotel_id, time, window_length) : 0;
+    }
+
+    int64_t GetRoomsAt(string_view hotel, int64_t time, int64_t window_length = SECONDS_IN_DAY) const {
+        const auto hotel_id = FindHotel(hotel);
+        return hotel_id ? GetHistory().GetRooms(*hotel_id, time, window_length) : 0;
+    }
+
+    // Copies the live window state into flat arrays; booking history is not
+    // part of it. The copy is cheap enough to take between two bookings, and
+    // a SnapshotWriter can then save it while booking goes on.
+    HotelManagerSnapshot CaptureSnapshot() const {
+        HotelManagerSnapshot snapshot;
+        snapshot.window_lengths = windows.GetWindowLengths();
+        snapshot.latest_time = windows.GetLatestTime();
+        snapshot.hotel_names.assign(hotel_names.begin(), hotel_names.end());
+
+        windows.ForEachBucket([&snapshot](int64_t time, uint32_t hotel_id, const HotelAggregate::Delta& delta) {
+            const size_t first_client = snapshot.clients.size();
+            const auto& clients = delta.clients;
+            snapshot.clients.insert(snapshot.clients.end(), clients.inline_values, clients.inline_values + clients.inline_size);
+            snapshot.clients.insert(snapshot.clients.end(), clients.rest.begin(), clients.rest.end());
+            snapshot.buckets.push_back({time, delta.rooms, hotel_id,
+                                        static_cast<uint32_t>(snapshot.clients.size() - first_client)});
+        });
+
+        return snapshot;
+    }
+
+    // Rebuilds the live window state from a snapshot file by replaying its
+    // buckets straight out of the mapping.
+    static HotelManager LoadSnapshot(const string& path) {
+        const SnapshotFile file(path);
+        const SnapshotHeader& header = file.GetHeader();
+
+        HotelManager manager(vector<int64_t>(file.GetWindowLengths(), file.GetWindowLengths() + header.window_count));
+        for (size_t hotel_id = 0; hotel_id < header.hotel_count; ++hotel_id)
+            manager.InternHotel(file.GetHotelName(hotel_id));
+
+        const int32_t* client = file.GetClients();
+        for (const SnapshotBucket* bucket = file.GetBuckets(); bucket != file.GetBuckets() + header.bucket_count; ++bucket) {
+            // The first booking of a bucket carries all of its rooms.
+            for (uint32_t i = 0; i < bucket->client_count; ++i, ++client)
+                manager.windows.Add(bucket->time, bucket->hotel_id, {*client, i == 0 ? bucket->rooms : 0});
+        }
+
+        if (header.latest_time != numeric_limits<int64_t>::min())
+            manager.windows.Advance(header.latest_time);
+        return manager;
+    }
+
+private:
+    struct Booking {
+        int client_id;
+        int64_t room_count;
+    };
+
+    struct HotelAggregate {
+        DistinctCountAggregate<int> clients;
+        SumAggregate<int64_t> rooms;
+
+        struct Delta {
+            DistinctCountAggregate<int>::Delta clients;
+            SumAggregate<int64_t>::Delta rooms = 0;
+        };
+
+        // Only the client decides whether a booking is new to its bucket.
+        static void Accumulate(Delta& delta, const Booking& booking, bool new_client) {
+            DistinctCountAggregate<int>::Accumulate(delta.clients, booking.client_id, new_client);
+            SumAggregate<int64_t>::Accumulate(delta.rooms, booking.room_count, true);
+        }
+
+        bool Add(const Booking& booking, uint64_t bucket) {
+            rooms.Add(booking.room_count, bucket);
+            return clients.Add(booking.client_id, bucket);
+        }
+
+        void Remove(const Delta& delta) {
+            clients.Remove(delta.clients);
+            rooms.Remove(delta.rooms);
+        }
+
+        const HotelAggregate& Get() const {
+            return *this;
+        }
+    };
+
+    // Hotel names are interned once into dense ids; the deque keeps the
+    // names the map keys point into stable.
+    deque<string> hotel_names;
+    unordered_map<string_view, uint32_t> hotel_ids;
+    SlidingWindows<uint32_t, Booking, HotelAggregate> windows;
+    optional<BookingHistory> history;
+
+    uint32_t InternHotel(string_view hotel) {
+        auto it = hotel_ids.find(hotel);
+        if (it != hotel_ids.end())
+            return it->second;
+
+        const uint32_t hotel_id = hotel_ids.size();
+        hotel_ids.emplace(hotel_names.emplace_back(hotel), hotel_id);
+        return hotel_id;
+    }
+
+    const BookingHistory& GetHistory() const {
+        if (!history)
+            throw logic_error("point-in-time queries need a HotelManager that keeps history");
+        return *history;
+    }
+
+    optional<uint32_t> FindHotel(string_view hotel) const {
+        auto it = hotel_ids.find(hotel);
+        if (it == hotel_ids.end())
+            return nullopt;
+        return it->second;
+    }
+};
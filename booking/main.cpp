@@ -1,101 +1,96 @@
-#include <iomanip>
-#include <iostream>
-#include <map>
-#include <set>
+#include "command_io.h"
+#include "hotel_manager.h"
+#include "partitioned_booking.h"
+
+#include <algorithm>
 #include <cstdint>
-#include <queue>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
 
 using namespace std;
 
-struct Booking {
-    int64_t time;
-    string hotel;
-    int client_id;
-    int64_t room_count;
-};
-
-class HotelManager {
-public:
-    HotelManager() {}
-
-    void Book(int64_t time, const string& hotel, int client_id, int64_t room_count) {
-        ReduceTime(time);
-
-        bookings.push({time, hotel, client_id, room_count});
-        clients[hotel].insert(client_id);
-
-        if (rooms.count(hotel) == 1) {
-            clients[hotel].insert(client_id);
-            rooms[hotel] += room_count;
+const uint64_t SNAPSHOT_INTERVAL = 1 << 20;
+
+// With a snapshot path the state is restored from it if it exists, saved in
+// the background every SNAPSHOT_INTERVAL commands and once more at the end.
+void ProcessSequentially(CommandReader& reader, uint64_t query_count, AnswerWriter& writer,
+                         const string& snapshot_path) {
+    HotelManager manager = !snapshot_path.empty() && filesystem::exists(snapshot_path)
+                           ? HotelManager::LoadSnapshot(snapshot_path)
+                           : HotelManager();
+    optional<SnapshotWriter> snapshot_writer;
+    if (!snapshot_path.empty())
+        snapshot_writer.emplace(snapshot_path);
+
+    Command command;
+    for (uint64_t query_id = 0; query_id < query_count && reader.Next(command); ++query_id) {
+        if (snapshot_writer && query_id > 0 && query_id % SNAPSHOT_INTERVAL == 0)
+            snapshot_writer->TrySave([&manager] { return manager.CaptureSnapshot(); });
+
+        switch (command.type) {
+        case CommandType::BOOK:
+            manager.Book(command.time, command.hotel, command.client_id, command.room_count);
+            break;
+        case CommandType::CLIENTS:
+            writer.WriteLine(manager.GetClients(command.hotel));
+            break;
+        case CommandType::ROOMS:
+            writer.WriteLine(manager.GetRooms(command.hotel));
+            break;
+        case CommandType::UNKNOWN:
+            break;
         }
-        else {
-            clients[hotel] = {client_id};
-            rooms[hotel] = room_count;
-        }
-    }
-
-    uint64_t GetClients(const string& hotel) const {
-        return clients.count(hotel) == 1 ? clients.at(hotel).size() : 0;
     }
 
-    uint64_t GetRooms(const string& hotel) const {
-        return rooms.count(hotel) == 1 ? rooms.at(hotel) : 0;
+    if (snapshot_writer) {
+        snapshot_writer->Wait();
+        snapshot_writer->TrySave([&manager] { return manager.CaptureSnapshot(); });
+        snapshot_writer->Wait();
     }
-
-private:
-    static const int SECONDS_IN_DAY = 86'400;
-
-    map<string, set<int>> clients;
-    map<string, int64_t> rooms;
-    queue<Booking> bookings;
-
-    void ReduceTime(const int64_t& time) {
-        while (!bookings.empty() && bookings.front().time <= (time - SECONDS_IN_DAY)) {
-            auto booking = bookings.front();
-            bookings.pop();
-
-            clients[booking.hotel].erase(booking.client_id);
-            rooms[booking.hotel] -= booking.room_count;
-        }
+}
+
+void ProcessPartitioned(CommandReader& reader, uint64_t query_count, AnswerWriter& writer, size_t shard_count) {
+    PartitionedBookingProcessor processor(shard_count, writer);
+
+    Command command;
+    for (uint64_t query_id = 0; query_id < query_count && reader.Next(command); ++query_id)
+        processor.Process(command);
+    processor.Finish();
+}
+
+// Usage: booking [--shards N] [--snapshot PATH]; with N > 1 hotels are spread
+// over N threads, snapshots are only kept by the single-threaded mode.
+int main(int argc, char* argv[]) {
+    size_t shard_count = 1;
+    string snapshot_path;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const string_view name = argv[i];
+        if (name == "--shards")
+            shard_count = max(1, atoi(argv[i + 1]));
+        else if (name == "--snapshot")
+            snapshot_path = argv[i + 1];
     }
-};
-
-
-int main() {
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
-
-    HotelManager manager;
-
-    int query_count;
-    cin >> query_count;
-
-    for (int query_id = 0; query_id < query_count; ++query_id) {
-        string query_type;
-        cin >> query_type;
 
-        if (query_type == "BOOK") {
-            int64_t time;
-            string hotel;
-            int client_id;
-            int64_t room_count;
-            cin >> time >> hotel >> client_id >> room_count;
-
-            manager.Book(time, hotel, client_id, room_count);
-        }
-        else if (query_type == "CLIENTS") {
-            string hotel;
-            cin >> hotel;
-
-            cout << manager.GetClients(hotel) << "\n";
-        }
-        else if (query_type == "ROOMS") {
-            string hotel;
-            cin >> hotel;
-
-            cout << manager.GetRooms(hotel) << "\n";
-        }
+    try {
+        CommandReader reader(STDIN_FILENO);
+        AnswerWriter writer(STDOUT_FILENO);
+
+        uint64_t query_count = 0;
+        reader.ReadCount(query_count);
+
+        if (shard_count > 1)
+            ProcessPartitioned(reader, query_count, writer, shard_count);
+        else
+            ProcessSequentially(reader, query_count, writer, snapshot_path);
+        writer.Flush();
+    } catch (exception& e) {
+        cerr << "booking failed: " << e.what() << endl;
+        return 1;
     }
 
     return 0;
-}
\ No newline at end of file
+}
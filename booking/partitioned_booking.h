@@ -0,0 +1,270 @@
+#pragma once
+
+#include "command_io.h"
+#include "hotel_manager.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity_log2 = 12) : items(size_t(1) << capacity_log2) {}
+
+    bool TryPush(const T& item) {
+        const size_t tail = this->tail.load(memory_order_relaxed);
+        if (tail - cached_head == items.size()) {
+            cached_head = head.load(memory_order_acquire);
+            if (tail - cached_head == items.size())
+                return false;
+        }
+        items[tail & (items.size() - 1)] = item;
+        this->tail.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& item) {
+        const size_t head = this->head.load(memory_order_relaxed);
+        if (head == cached_tail) {
+            cached_tail = tail.load(memory_order_acquire);
+            if (head == cached_tail)
+                return false;
+        }
+        item = items[head & (items.size() - 1)];
+        this->head.store(head + 1, memory_order_release);
+        return true;
+    }
+
+private:
+    vector<T> items;
+
+    // Producer and consumer indices live on separate cache lines, each next to
+    // the owner's cached copy of the other side's index.
+    alignas(64) atomic<size_t> tail = 0;
+    size_t cached_head = 0;
+    alignas(64) atomic<size_t> head = 0;
+    size_t cached_tail = 0;
+};
+
+// Waits out a busy queue: yields for a while, then sleeps for doubling
+// intervals, so a worker whose queue stays empty stops taking a core away
+// from the dispatcher and the other shards.
+class Backoff {
+public:
+    void Pause() {
+        if (yields < MAX_YIELDS) {
+            ++yields;
+            this_thread::yield();
+            return;
+        }
+        this_thread::sleep_for(sleep);
+        sleep = min(2 * sleep, MAX_SLEEP);
+    }
+
+private:
+    static const size_t MAX_YIELDS = 64;
+    static constexpr chrono::microseconds MIN_SLEEP{1};
+    static constexpr chrono::microseconds MAX_SLEEP{1000};
+
+    size_t yields = 0;
+    chrono::microseconds sleep = MIN_SLEEP;
+};
+
+// Runs the command stream on shard_count worker threads, each owning the
+// HotelManager of the hotels assigned to it. Hotels are interned by the
+// dispatching thread and assigned to shards round-robin; every query carries
+// the time of the latest booking as a watermark, so a shard expires its own
+// bookings exactly as a single HotelManager would have. Answers are written in
+// input order, one batch behind the dispatcher.
+class PartitionedBookingProcessor {
+public:
+    PartitionedBookingProcessor(size_t shard_count, AnswerWriter& writer)
+        : writer(writer)
+        , shards(shard_count) {
+        for (auto& shard : shards) {
+            shard = make_unique<Shard>();
+            shard->worker = thread(&PartitionedBookingProcessor::RunShard, shard.get());
+        }
+        for (auto& batch : batches)
+            batch.answers.reserve(BATCH_SIZE);
+    }
+
+    PartitionedBookingProcessor(const PartitionedBookingProcessor&) = delete;
+    PartitionedBookingProcessor& operator=(const PartitionedBookingProcessor&) = delete;
+
+    ~PartitionedBookingProcessor() {
+        for (auto& shard : shards) {
+            Send(*shard, Message::Stop());
+            shard->worker.join();
+        }
+    }
+
+    void Process(const Command& command) {
+        Batch& batch = batches[current_batch];
+
+        switch (command.type) {
+        case CommandType::BOOK: {
+            watermark = command.time;
+            const auto [hotel, shard] = InternHotel(command.hotel);
+            Send(*shards[shard], {Message::Type::BOOK, command.time, hotel, command.client_id, command.room_count});
+            break;
+        }
+        case CommandType::CLIENTS:
+        case CommandType::ROOMS: {
+            uint64_t& answer = batch.answers.emplace_back(0);
+            auto it = hotel_ids.find(command.hotel);
+            if (it == hotel_ids.end())
+                break;
+
+            const Message::Type type = command.type == CommandType::CLIENTS ? Message::Type::CLIENTS : Message::Type::ROOMS;
+            Send(*shards[it->second.shard], {type, watermark, it->second.name, 0, 0, &answer});
+            break;
+        }
+        case CommandType::UNKNOWN:
+            break;
+        }
+
+        if (++batch.commands == BATCH_SIZE)
+            CloseBatch();
+    }
+
+    // Writes the answers of everything processed so far.
+    void Finish() {
+        CloseBatch();
+        CompleteBatch(batches[current_batch ^ 1]);
+    }
+
+private:
+    static const size_t BATCH_SIZE = 1 << 14;
+
+    struct Message {
+        enum class Type {
+            BOOK,
+            CLIENTS,
+            ROOMS,
+            STOP,
+        };
+
+        Type type;
+        int64_t time = 0;
+        string_view hotel;
+        int client_id = 0;
+        int64_t room_count = 0;
+        uint64_t* answer = nullptr;
+
+        static Message Stop() {
+            Message message{};
+            message.type = Type::STOP;
+            return message;
+        }
+    };
+
+    struct Shard {
+        SpscQueue<Message> queue;
+        HotelManager manager;
+        thread worker;
+        alignas(64) atomic<uint64_t> processed = 0;
+        uint64_t sent = 0;
+    };
+
+    struct HotelEntry {
+        string_view name;
+        size_t shard;
+    };
+
+    struct Batch {
+        size_t commands = 0;
+        vector<uint64_t> answers;
+        vector<uint64_t> shard_targets;
+    };
+
+    AnswerWriter& writer;
+    vector<unique_ptr<Shard>> shards;
+
+    deque<string> hotel_names;
+    unordered_map<string_view, HotelEntry> hotel_ids;
+    int64_t watermark = 0;
+
+    // Answers of the open batch are being filled in while the previous batch
+    // may still be in flight.
+    Batch batches[2];
+    size_t current_batch = 0;
+
+    HotelEntry InternHotel(string_view hotel) {
+        auto it = hotel_ids.find(hotel);
+        if (it != hotel_ids.end())
+            return it->second;
+
+        const HotelEntry entry{hotel_names.emplace_back(hotel), hotel_ids.size() % shards.size()};
+        hotel_ids.emplace(entry.name, entry);
+        return entry;
+    }
+
+    static void Send(Shard& shard, const Message& message) {
+        for (Backoff backoff; !shard.queue.TryPush(message);)
+            backoff.Pause();
+        ++shard.sent;
+    }
+
+    // Waits for the previous batch, writes its answers and opens a new batch.
+    void CloseBatch() {
+        Batch& batch = batches[current_batch];
+        batch.shard_targets.clear();
+        for (const auto& shard : shards)
+            batch.shard_targets.push_back(shard->sent);
+
+        current_batch ^= 1;
+        CompleteBatch(batches[current_batch]);
+    }
+
+    void CompleteBatch(Batch& batch) {
+        for (size_t shard = 0; shard < batch.shard_targets.size(); ++shard) {
+            for (Backoff backoff; shards[shard]->processed.load(memory_order_acquire) < batch.shard_targets[shard];)
+                backoff.Pause();
+        }
+
+        for (uint64_t answer : batch.answers)
+            writer.WriteLine(answer);
+
+        batch.commands = 0;
+        batch.answers.clear();
+        batch.shard_targets.clear();
+    }
+
+    static void RunShard(Shard* shard) {
+        for (Message message;;) {
+            for (Backoff backoff; !shard->queue.TryPop(message);)
+                backoff.Pause();
+
+            switch (message.type) {
+            case Message::Type::BOOK:
+                shard->manager.Book(message.time, message.hotel, message.client_id, message.room_count);
+                break;
+            case Message::Type::CLIENTS:
+                shard->manager.Advance(message.time);
+                *message.answer = shard->manager.GetClients(message.hotel);
+                break;
+            case Message::Type::ROOMS:
+                shard->manager.Advance(message.time);
+                *message.answer = shard->manager.GetRooms(message.hotel);
+                break;
+            case Message::Type::STOP:
+                return;
+            }
+
+            shard->processed.store(shard->processed.load(memory_order_relaxed) + 1, memory_order_release);
+        }
+    }
+};
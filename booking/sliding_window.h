@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// FIFO queue over a power-of-two circular array; elements are addressed by
+// their position from the front.
+template <typename T>
+class RingBuffer {
+public:
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    T& operator[](size_t index) {
+        return items[(head + index) & (items.size() - 1)];
+    }
+
+    const T& operator[](size_t index) const {
+        return items[(head + index) & (items.size() - 1)];
+    }
+
+    T& front() {
+        return (*this)[0];
+    }
+
+    void push_back(T item) {
+        if (count == items.size())
+            Grow();
+        (*this)[count++] = move(item);
+    }
+
+    void pop_front() {
+        head = (head + 1) & (items.size() - 1);
+        --count;
+    }
+
+private:
+    vector<T> items;
+    size_t head = 0;
+    size_t count = 0;
+
+    void Grow() {
+        vector<T> grown(items.empty() ? 16 : 2 * items.size());
+        for (size_t i = 0; i < count; ++i)
+            grown[i] = move((*this)[i]);
+        items = move(grown);
+        head = 0;
+    }
+};
+
+// Aggregates are maintained event by event but expire a bucket at a time.
+// Add is told which bucket an event falls into (bucket numbers only grow) and
+// reports whether its value is new to that bucket; Accumulate folds the event
+// into the bucket's Delta, and Remove takes a whole Delta back out.
+template <typename Value>
+class SumAggregate {
+public:
+    using Delta = Value;
+
+    static void Accumulate(Delta& delta, const Value& value, bool) {
+        delta += value;
+    }
+
+    bool Add(const Value& value, uint64_t) {
+        total += value;
+        return true;
+    }
+
+    void Remove(const Delta& delta) {
+        total -= delta;
+    }
+
+    Value Get() const {
+        return total;
+    }
+
+private:
+    Value total = Value();
+};
+
+// Counts for each value the buckets it occurs in rather than its events, so a
+// bucket only has to list its distinct values once.
+template <typename Value>
+class DistinctCountAggregate {
+public:
+    // Most buckets hold a handful of distinct values, kept inline.
+    struct Delta {
+        static const size_t INLINE_SIZE = 4;
+
+        Value inline_values[INLINE_SIZE];
+        uint32_t inline_size = 0;
+        vector<Value> rest;
+    };
+
+    static void Accumulate(Delta& delta, const Value& value, bool new_in_bucket) {
+        if (!new_in_bucket)
+            return;
+
+        if (delta.inline_size < Delta::INLINE_SIZE)
+            delta.inline_values[delta.inline_size++] = value;
+        else
+            delta.rest.push_back(value);
+    }
+
+    bool Add(const Value& value, uint64_t bucket) {
+        Occurrences& occurrences = counts[value];
+        if (occurrences.last_bucket == bucket)
+            return false;
+
+        occurrences.last_bucket = bucket;
+        ++occurrences.buckets;
+        return true;
+    }
+
+    void Remove(const Delta& delta) {
+        for (uint32_t i = 0; i < delta.inline_size; ++i)
+            Remove(delta.inline_values[i]);
+        for (const Value& value : delta.rest)
+            Remove(value);
+    }
+
+    uint64_t Get() const {
+        return counts.size();
+    }
+
+private:
+    struct Occurrences {
+        uint32_t buckets = 0;
+        uint64_t last_bucket = numeric_limits<uint64_t>::max();
+    };
+
+    unordered_map<Value, Occurrences> counts;
+
+    void Remove(const Value& value) {
+        auto it = counts.find(value);
+        if (--it->second.buckets == 0)
+            counts.erase(it);
+    }
+};
+
+// Removals arrive in insertion order, so a monotonic queue of the values that
+// may still become the maximum is enough; a bucket only needs to know how many
+// events it removes.
+template <typename Value>
+class MaxAggregate {
+public:
+    using Delta = uint64_t;
+
+    static void Accumulate(Delta& delta, const Value&, bool) {
+        ++delta;
+    }
+
+    bool Add(const Value& value, uint64_t) {
+        while (!candidates.empty() && !(value < candidates.back().second))
+            candidates.pop_back();
+        candidates.emplace_back(added++, value);
+        return true;
+    }
+
+    void Remove(const Delta& delta) {
+        removed += delta;
+        while (!candidates.empty() && candidates.front().first < removed)
+            candidates.pop_front();
+    }
+
+    Value Get() const {
+        return candidates.empty() ? Value() : candidates.front().second;
+    }
+
+private:
+    deque<pair<uint64_t, Value>> candidates;
+    uint64_t added = 0;
+    uint64_t removed = 0;
+};
+
+// Per-key aggregates over several trailing time windows at once. An event at
+// time t belongs to a window of length L > 0 while now - L < t <= now. Events
+// of the same key and second are pre-aggregated into one bucket, stored once
+// for the longest window; each window keeps its own cursor into the buckets
+// and its own aggregates. Event times must not decrease.
+template <typename Key, typename Value, typename Aggregate>
+class SlidingWindows {
+public:
+    explicit SlidingWindows(vector<int64_t> window_lengths)
+        : window_lengths(move(window_lengths))
+        , expired(this->window_lengths.size()) {}
+
+    // Buckets point into the key table, so a copy would share them.
+    SlidingWindows(const SlidingWindows&) = delete;
+    SlidingWindows& operator=(const SlidingWindows&) = delete;
+    SlidingWindows(SlidingWindows&&) = default;
+    SlidingWindows& operator=(SlidingWindows&&) = default;
+
+    size_t GetWindowCount() const {
+        return window_lengths.size();
+    }
+
+    void Add(int64_t time, const Key& key, const Value& value) {
+        Advance(time);
+
+        KeyState& state = keys[key];
+        if (state.windows.empty()) {
+            state.key = key;
+            state.windows.resize(window_lengths.size());
+        }
+
+        if (state.open_bucket < dropped || state.open_bucket - dropped >= buckets.size()
+            || buckets[state.open_bucket - dropped].time != time) {
+            state.open_bucket = dropped + buckets.size();
+            buckets.push_back({time, &state, {}});
+        }
+        // Every window sees the same events, so they agree on whether the
+        // value is new to the bucket.
+        bool new_in_bucket = true;
+        for (Aggregate& aggregate : state.windows)
+            new_in_bucket = aggregate.Add(value, state.open_bucket);
+        Aggregate::Accumulate(buckets[state.open_bucket - dropped].delta, value, new_in_bucket);
+    }
+
+    // Expires everything that has left each window by time now.
+    void Advance(int64_t now) {
+        latest_time = max(latest_time, now);
+
+        size_t fully_expired = buckets.size();
+        for (size_t window = 0; window < window_lengths.size(); ++window) {
+            size_t& cursor = expired[window];
+            for (; cursor < buckets.size() && buckets[cursor].time <= now - window_lengths[window]; ++cursor)
+                buckets[cursor].state->windows[window].Remove(buckets[cursor].delta);
+            fully_expired = min(fully_expired, cursor);
+        }
+
+        for (size_t i = 0; i < fully_expired; ++i)
+            buckets.pop_front();
+        dropped += fully_expired;
+        for (size_t& cursor : expired)
+            cursor -= fully_expired;
+    }
+
+    const vector<int64_t>& GetWindowLengths() const {
+        return window_lengths;
+    }
+
+    // The latest time the windows were advanced to.
+    int64_t GetLatestTime() const {
+        return latest_time;
+    }
+
+    // Visits the stored buckets oldest first as (time, key, delta).
+    template <typename Visitor>
+    void ForEachBucket(Visitor visitor) const {
+        for (size_t i = 0; i < buckets.size(); ++i)
+            visitor(buckets[i].time, buckets[i].state->key, buckets[i].delta);
+    }
+
+    decltype(auto) Get(size_t window, const Key& key) const {
+        auto it = keys.find(key);
+        const Aggregate& aggregate = it != keys.end() ? it->second.windows[window] : EMPTY;
+        return aggregate.Get();
+    }
+
+private:
+    struct KeyState {
+        Key key = Key();
+        // Position of the key's latest bucket, counted from the first bucket
+        // ever stored.
+        size_t open_bucket = numeric_limits<size_t>::max();
+        vector<Aggregate> windows;
+    };
+
+    struct Bucket {
+        int64_t time;
+        KeyState* state;
+        typename Aggregate::Delta delta;
+    };
+
+    inline static const Aggregate EMPTY{};
+
+    vector<int64_t> window_lengths;
+    // Nodes of unordered_map keep their address, so buckets point at them.
+    unordered_map<Key, KeyState> keys;
+    RingBuffer<Bucket> buckets;
+    size_t dropped = 0;
+    vector<size_t> expired;
+    int64_t latest_time = numeric_limits<int64_t>::min();
+};
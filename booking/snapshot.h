@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct SnapshotBucket {
+    int64_t time;
+    int64_t rooms;
+    uint32_t hotel_id;
+    uint32_t client_count;
+};
+
+// Live window state of a HotelManager: its hotels and the bookings of the
+// longest window, pre-aggregated per (hotel, second) bucket, oldest first.
+struct HotelManagerSnapshot {
+    vector<int64_t> window_lengths;
+    int64_t latest_time = 0;
+    vector<string> hotel_names;
+    vector<SnapshotBucket> buckets;
+    // Distinct clients of every bucket, one bucket after another.
+    vector<int32_t> clients;
+};
+
+// The file is the header followed by flat arrays that are used in place once
+// the file is mapped: window lengths, hotel name offsets, buckets, clients
+// and the concatenated hotel names.
+struct SnapshotHeader {
+    uint64_t magic;
+    uint64_t checksum;
+    uint64_t window_count;
+    int64_t latest_time;
+    uint64_t hotel_count;
+    uint64_t name_bytes;
+    uint64_t bucket_count;
+    uint64_t client_count;
+};
+
+const uint64_t SNAPSHOT_MAGIC = 0x31'4e'53'4c'45'54'4f'48;  // "HOTELSN1"
+
+// FNV-1a over everything after the header.
+inline uint64_t SnapshotChecksum(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    return hash;
+}
+
+inline void ThrowSnapshotError(const string& what) {
+    throw system_error(errno, generic_category(), what);
+}
+
+// Writes path.tmp, syncs it, renames it over path and syncs the directory,
+// so a crash leaves either the old or the new snapshot.
+inline void SaveSnapshot(const HotelManagerSnapshot& snapshot, const string& path) {
+    SnapshotHeader header{};
+    header.magic = SNAPSHOT_MAGIC;
+    header.window_count = snapshot.window_lengths.size();
+    header.latest_time = snapshot.latest_time;
+    header.hotel_count = snapshot.hotel_names.size();
+    header.bucket_count = snapshot.buckets.size();
+    header.client_count = snapshot.clients.size();
+
+    vector<uint64_t> name_offsets = {0};
+    for (const string& name : snapshot.hotel_names)
+        name_offsets.push_back(name_offsets.back() + name.size());
+    header.name_bytes = name_offsets.back();
+
+    string data(sizeof(header), '\0');
+    auto append = [&data](const void* source, size_t size) {
+        data.append(static_cast<const char*>(source), size);
+    };
+    append(snapshot.window_lengths.data(), snapshot.window_lengths.size() * sizeof(int64_t));
+    append(name_offsets.data(), name_offsets.size() * sizeof(uint64_t));
+    append(snapshot.buckets.data(), snapshot.buckets.size() * sizeof(SnapshotBucket));
+    append(snapshot.clients.data(), snapshot.clients.size() * sizeof(int32_t));
+    for (const string& name : snapshot.hotel_names)
+        data += name;
+
+    header.checksum = SnapshotChecksum(data.data() + sizeof(header), data.size() - sizeof(header));
+    memcpy(data.data(), &header, sizeof(header));
+
+    const string tmp_path = path + ".tmp";
+    const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        ThrowSnapshotError("open " + tmp_path);
+
+    for (size_t written = 0; written < data.size();) {
+        const ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0) {
+            const int error = errno;
+            ::close(fd);
+            errno = error;
+            ThrowSnapshotError("write " + tmp_path);
+        }
+        written += result;
+    }
+
+    if (::fsync(fd) != 0) {
+        const int error = errno;
+        ::close(fd);
+        errno = error;
+        ThrowSnapshotError("fsync " + tmp_path);
+    }
+    ::close(fd);
+
+    if (::rename(tmp_path.c_str(), path.c_str()) != 0)
+        ThrowSnapshotError("rename " + tmp_path);
+
+    // The rename itself is only durable once the directory entry is synced.
+    string directory = filesystem::path(path).parent_path().string();
+    if (directory.empty())
+        directory = ".";
+    const int directory_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (directory_fd < 0)
+        ThrowSnapshotError("open " + directory);
+    if (::fsync(directory_fd) != 0) {
+        const int error = errno;
+        ::close(directory_fd);
+        errno = error;
+        ThrowSnapshotError("fsync " + directory);
+    }
+    ::close(directory_fd);
+}
+
+// Read-only mapping of a snapshot file, validated on open.
+class SnapshotFile {
+public:
+    explicit SnapshotFile(const string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            ThrowSnapshotError("open " + path);
+
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            const int error = errno;
+            ::close(fd);
+            errno = error;
+            ThrowSnapshotError("stat " + path);
+        }
+        size = info.st_size;
+        if (size < sizeof(SnapshotHeader)) {
+            ::close(fd);
+            throw runtime_error("snapshot " + path + " is truncated");
+        }
+
+        void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+            ThrowSnapshotError("mmap " + path);
+        data = static_cast<const char*>(mapping);
+
+        const SnapshotHeader& header = GetHeader();
+        const bool valid = header.magic == SNAPSHOT_MAGIC
+                && size == sizeof(SnapshotHeader)
+                           + header.window_count * sizeof(int64_t)
+                           + (header.hotel_count + 1) * sizeof(uint64_t)
+                           + header.bucket_count * sizeof(SnapshotBucket)
+                           + header.client_count * sizeof(int32_t)
+                           + header.name_bytes
+                && header.checksum == SnapshotChecksum(data + sizeof(header), size - sizeof(header));
+        if (!valid) {
+            ::munmap(const_cast<char*>(data), size);
+            throw runtime_error("snapshot " + path + " is corrupted");
+        }
+    }
+
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    ~SnapshotFile() {
+        ::munmap(const_cast<char*>(data), size);
+    }
+
+    const SnapshotHeader& GetHeader() const {
+        return *reinterpret_cast<const SnapshotHeader*>(data);
+    }
+
+    const int64_t* GetWindowLengths() const {
+        return reinterpret_cast<const int64_t*>(data + sizeof(SnapshotHeader));
+    }
+
+    string_view GetHotelName(size_t hotel_id) const {
+        const char* names = reinterpret_cast<const char*>(GetClients() + GetHeader().client_count);
+        return {names + GetNameOffsets()[hotel_id], GetNameOffsets()[hotel_id + 1] - GetNameOffsets()[hotel_id]};
+    }
+
+    const SnapshotBucket* GetBuckets() const {
+        return reinterpret_cast<const SnapshotBucket*>(GetNameOffsets() + GetHeader().hotel_count + 1);
+    }
+
+    const int32_t* GetClients() const {
+        return reinterpret_cast<const int32_t*>(GetBuckets() + GetHeader().bucket_count);
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+
+    const uint64_t* GetNameOffsets() const {
+        return reinterpret_cast<const uint64_t*>(GetWindowLengths() + GetHeader().window_count);
+    }
+};
+
+// Saves snapshots on a background thread, one at a time.
+class SnapshotWriter {
+public:
+    using SaveFunction = function<void(const HotelManagerSnapshot& snapshot, const string& path)>;
+
+    // save runs on the background thread; tests pass their own to control
+    // how long a save takes.
+    explicit SnapshotWriter(string path, SaveFunction save = SaveSnapshot)
+        : path(move(path))
+        , save(move(save)) {}
+
+    ~SnapshotWriter() {
+        if (pending.valid())
+            pending.wait();
+    }
+
+    // Unless the previous snapshot is still being written, calls capture()
+    // on this thread and starts saving its result; returns whether it did.
+    // A busy writer never captures. Errors of the previous save are rethrown.
+    template <typename Capture>
+    bool TrySave(Capture capture) {
+        if (pending.valid()) {
+            if (pending.wait_for(chrono::seconds(0)) != future_status::ready)
+                return false;
+            pending.get();
+        }
+
+        pending = async(launch::async, [this, snapshot = HotelManagerSnapshot(capture())] {
+            save(snapshot, path);
+        });
+        return true;
+    }
+
+    void Wait() {
+        if (pending.valid())
+            pending.get();
+    }
+
+private:
+    string path;
+    SaveFunction save;
+    future<void> pending;
+};
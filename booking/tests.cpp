@@ -0,0 +1,491 @@
+#include "test_runner.h"
+#include "booking_history.h"
+#include "command_io.h"
+#include "hotel_manager.h"
+#include "partitioned_booking.h"
+#include "sliding_window.h"
+#include "snapshot.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct BookingRecord {
+    int64_t time;
+    int client_id;
+    int64_t room_count;
+};
+
+// Point-in-time answers by scanning every booking of the hotel.
+pair<uint64_t, int64_t> BruteForceWindow(const vector<BookingRecord>& bookings, int64_t time, int64_t window_length) {
+    set<int> clients;
+    int64_t rooms = 0;
+    for (const BookingRecord& booking : bookings) {
+        if (booking.time > time - window_length && booking.time <= time) {
+            clients.insert(booking.client_id);
+            rooms += booking.room_count;
+        }
+    }
+    return {clients.size(), rooms};
+}
+
+void TestBookingHistoryRandom() {
+    for (uint64_t seed = 1; seed <= 20; ++seed) {
+        mt19937_64 rng(seed);
+        const uint32_t hotel_count = 1 + rng() % 4;
+        const int client_count = 1 + rng() % 30;
+        const size_t booking_count = rng() % 600;
+
+        BookingHistory history;
+        vector<vector<BookingRecord>> bookings(hotel_count + 1);
+        int64_t time = static_cast<int64_t>(rng() % 1000) - 500;
+
+        auto check = [&](uint32_t hotel_id, int64_t at, int64_t window_length) {
+            const auto [clients, rooms] = BruteForceWindow(bookings[hotel_id], at, window_length);
+            ASSERT_EQUAL(history.GetClients(hotel_id, at, window_length), clients);
+            ASSERT_EQUAL(history.GetRooms(hotel_id, at, window_length), rooms);
+        };
+
+        for (size_t i = 0; i < booking_count; ++i) {
+            // Several bookings share a second now and then.
+            time += rng() % 3 == 0 ? 0 : rng() % 50;
+            const uint32_t hotel_id = rng() % hotel_count;
+            const BookingRecord booking{time, static_cast<int>(rng() % client_count), 1 + static_cast<int64_t>(rng() % 5)};
+            history.Add(booking.time, hotel_id, booking.client_id, booking.room_count);
+            bookings[hotel_id].push_back(booking);
+
+            if (rng() % 8 == 0) {
+                const int64_t at = time - static_cast<int64_t>(rng() % 2000) + 100;
+                const int64_t window_length = 1 + rng() % 500;
+                for (uint32_t hotel = 0; hotel <= hotel_count; ++hotel)
+                    check(hotel, at, window_length);
+            }
+        }
+
+        for (uint32_t hotel = 0; hotel <= hotel_count; ++hotel) {
+            for (int64_t window_length : {int64_t(1), int64_t(60), int64_t(1) << 40})
+                check(hotel, time, window_length);
+        }
+    }
+}
+
+// The maximum follows the window as it slides: old maxima expire, an equal
+// maximum that is still inside keeps the answer, and an empty window gives
+// Value().
+void TestMaxAggregate() {
+    SlidingWindows<int, int, MaxAggregate<int>> windows({10, 100});
+    ASSERT_EQUAL(windows.Get(0, 1), 0);
+
+    windows.Add(1, 1, 7);
+    windows.Add(2, 1, 9);
+    windows.Add(5, 1, 9);
+    windows.Add(5, 1, 3);
+    windows.Add(8, 1, 4);
+    ASSERT_EQUAL(windows.Get(0, 1), 9);
+    ASSERT_EQUAL(windows.Get(0, 2), 0);
+
+    // Only the first 9 has left the short window; the second keeps it at 9.
+    windows.Advance(12);
+    ASSERT_EQUAL(windows.Get(0, 1), 9);
+    windows.Advance(15);
+    ASSERT_EQUAL(windows.Get(0, 1), 4);
+    ASSERT_EQUAL(windows.Get(1, 1), 9);
+    windows.Advance(18);
+    ASSERT_EQUAL(windows.Get(0, 1), 0);
+    ASSERT_EQUAL(windows.Get(1, 1), 9);
+    windows.Advance(200);
+    ASSERT_EQUAL(windows.Get(1, 1), 0);
+
+    // Against a scan of the events still in each window.
+    for (uint64_t seed = 1; seed <= 10; ++seed) {
+        mt19937_64 rng(seed);
+        const vector<int64_t> window_lengths = {1, 7, 50};
+        SlidingWindows<int, int, MaxAggregate<int>> random_windows(window_lengths);
+        vector<tuple<int64_t, int, int>> events;
+        int64_t time = 0;
+        for (size_t i = 0; i < 2000; ++i) {
+            time += rng() % 3 == 0 ? 0 : rng() % 10;
+            const int key = rng() % 3;
+            // Few distinct values, so equal maxima are common.
+            const int value = 1 + rng() % 5;
+            random_windows.Add(time, key, value);
+            events.emplace_back(time, key, value);
+
+            for (size_t window = 0; window < window_lengths.size(); ++window) {
+                for (int checked_key = 0; checked_key < 3; ++checked_key) {
+                    int expected = 0;
+                    for (auto it = events.rbegin(); it != events.rend() && get<0>(*it) > time - window_lengths[window]; ++it) {
+                        if (get<1>(*it) == checked_key)
+                            expected = max(expected, get<2>(*it));
+                    }
+                    ASSERT_EQUAL(random_windows.Get(window, checked_key), expected);
+                }
+            }
+        }
+    }
+}
+
+// What the reader makes of its input, one command per line, ending with the
+// error it throws, if any.
+string DescribeCommands(CommandReader& reader) {
+    ostringstream output;
+    try {
+        uint64_t count;
+        if (!reader.ReadCount(count))
+            return "no count";
+        output << count << '\n';
+
+        for (Command command; reader.Next(command);) {
+            switch (command.type) {
+            case CommandType::BOOK:
+                output << "BOOK " << command.time << ' ' << command.hotel << ' ' << command.client_id << ' '
+                       << command.room_count << '\n';
+                break;
+            case CommandType::CLIENTS:
+                output << "CLIENTS " << command.hotel << '\n';
+                break;
+            case CommandType::ROOMS:
+                output << "ROOMS " << command.hotel << '\n';
+                break;
+            case CommandType::UNKNOWN:
+                output << "UNKNOWN\n";
+                break;
+            }
+        }
+    } catch (exception& e) {
+        output << "error: " << e.what();
+    }
+    return output.str();
+}
+
+// Feeds the pieces through a pipe, each one only after the reader has taken
+// everything before it, so every piece boundary is also a read boundary.
+string DescribePipedCommands(const vector<string>& pieces) {
+    int fds[2];
+    ASSERT(pipe(fds) == 0);
+
+    thread writer([&pieces, write_fd = fds[1]] {
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            if (i > 0) {
+                for (int pending = 1; pending > 0;) {
+                    ioctl(write_fd, FIONREAD, &pending);
+                    this_thread::yield();
+                }
+            }
+            for (size_t written = 0; written < pieces[i].size();) {
+                const ssize_t result = write(write_fd, pieces[i].data() + written, pieces[i].size() - written);
+                if (result < 0)
+                    break;
+                written += result;
+            }
+        }
+        close(write_fd);
+    });
+
+    string description;
+    {
+        CommandReader reader(fds[0]);
+        description = DescribeCommands(reader);
+    }
+    writer.join();
+    close(fds[0]);
+    return description;
+}
+
+// A non-empty regular file is mapped rather than read.
+string DescribeFileCommands(const string& input) {
+    FILE* file = tmpfile();
+    ASSERT(file != nullptr);
+    fwrite(input.data(), 1, input.size(), file);
+    fflush(file);
+
+    string description;
+    {
+        CommandReader reader(fileno(file));
+        description = DescribeCommands(reader);
+    }
+    fclose(file);
+    return description;
+}
+
+void TestCommandReader() {
+    const string expected = "3\nBOOK 10 hotel 1 2\nCLIENTS hotel\nROOMS hotel\n";
+
+    // Lines split between reads, blank lines, and a last line without '\n'.
+    ASSERT_EQUAL(DescribePipedCommands({"3\nBOOK 10 hot", "el 1 2\nCLIENTS ho", "tel\nROOMS hotel"}), expected);
+    ASSERT_EQUAL(DescribePipedCommands({"3", "\n\nBOOK 10 hotel 1 2\n", "\n  \nCLIENTS hotel\n", "ROOMS", " hotel\n"}),
+                 expected);
+    ASSERT_EQUAL(DescribeFileCommands("3\nBOOK 10 hotel 1 2\nCLIENTS hotel\nROOMS hotel"), expected);
+
+    // CRLF line endings.
+    ASSERT_EQUAL(DescribePipedCommands({"3\r\nBOOK 10 hotel 1 2\r\nCLIENTS hotel\r", "\nROOMS hotel\r\n"}), expected);
+    ASSERT_EQUAL(DescribeFileCommands("3\r\nBOOK 10 hotel 1 2\r\nCLIENTS hotel\r\nROOMS hotel\r\n"), expected);
+
+    // A line longer than a read block grows the buffer.
+    const string long_name(3 << 20, 'h');
+    ASSERT_EQUAL(DescribePipedCommands({"1\nCLIENTS ", long_name, "\n"}), "1\nCLIENTS " + long_name + "\n");
+
+    // Nothing at all to read.
+    ASSERT_EQUAL(DescribePipedCommands({}), "no count");
+    ASSERT_EQUAL(DescribeFileCommands(""), "no count");
+
+    // Malformed commands.
+    ASSERT_EQUAL(DescribePipedCommands({"2\nCANCEL hotel\nROOMS hotel\n"}), "2\nUNKNOWN\nROOMS hotel\n");
+    ASSERT_EQUAL(DescribePipedCommands({"1\nBOOK x hotel 1 2\n"}), "1\nerror: malformed number: \"x\"");
+    ASSERT_EQUAL(DescribePipedCommands({"1\nBOOK 10 hotel 1 2x\n"}), "1\nerror: malformed number: \"2x\"");
+    ASSERT_EQUAL(DescribePipedCommands({"1\nBOOK 10 hotel 1\n"}), "1\nerror: malformed number: \"\"");
+    ASSERT_EQUAL(DescribePipedCommands({"1\nBOOK 10 hotel 99999999999 2\n"}),
+                 "1\nerror: number out of range: 99999999999");
+    ASSERT_EQUAL(DescribeFileCommands("-1\n"), "error: malformed number: \"-1\"");
+}
+
+void TestSpscQueue() {
+    // Four slots: fill until full, drain until empty, and go round the ring
+    // several times, so indices wrap with the queue both full and empty.
+    SpscQueue<int> queue(2);
+    int next_push = 0;
+    int next_pop = 0;
+    for (size_t round = 0; round < 5; ++round) {
+        while (queue.TryPush(next_push))
+            ++next_push;
+        ASSERT_EQUAL(next_push - next_pop, 4);
+
+        for (int item; queue.TryPop(item); ++next_pop)
+            ASSERT_EQUAL(item, next_pop);
+        ASSERT_EQUAL(next_pop, next_push);
+
+        // A partial fill moves the start of the next round within the ring.
+        ASSERT(queue.TryPush(next_push++));
+        int item;
+        ASSERT(queue.TryPop(item));
+        ASSERT_EQUAL(item, next_pop++);
+    }
+
+    // One producer and one consumer thread keep the queue going in and out
+    // of both states.
+    const int item_count = 200000;
+    SpscQueue<int> shared(2);
+    thread producer([&shared] {
+        for (int item = 0; item < item_count; ++item) {
+            while (!shared.TryPush(item))
+                this_thread::yield();
+        }
+    });
+    int expected = 0;
+    bool in_order = true;
+    for (int item; expected < item_count;) {
+        if (!shared.TryPop(item)) {
+            this_thread::yield();
+            continue;
+        }
+        in_order = in_order && item == expected;
+        ++expected;
+    }
+    producer.join();
+    ASSERT(in_order);
+    int item;
+    ASSERT(!shared.TryPop(item));
+}
+
+// Commands over a handful of hotels, with queries on hotels that were never
+// booked and unknown commands mixed in. Hotel names point into hotels.
+vector<Command> GenerateCommands(mt19937_64& rng, const vector<string>& hotels, size_t command_count) {
+    vector<Command> commands;
+    int64_t time = 0;
+    for (size_t i = 0; i < command_count; ++i) {
+        Command command;
+        const uint64_t kind = rng() % 10;
+        command.hotel = hotels[rng() % hotels.size()];
+        if (kind < 5) {
+            time += rng() % 3 == 0 ? 0 : rng() % 2000;
+            command.type = CommandType::BOOK;
+            command.time = time;
+            command.client_id = rng() % 100;
+            command.room_count = 1 + rng() % 5;
+        } else {
+            command.type = kind < 7 ? CommandType::CLIENTS : kind < 9 ? CommandType::ROOMS : CommandType::UNKNOWN;
+        }
+        commands.push_back(command);
+    }
+    return commands;
+}
+
+vector<uint64_t> ProcessSequentially(const vector<Command>& commands) {
+    HotelManager manager;
+    vector<uint64_t> answers;
+    for (const Command& command : commands) {
+        if (command.type == CommandType::BOOK)
+            manager.Book(command.time, command.hotel, command.client_id, command.room_count);
+        else if (command.type == CommandType::CLIENTS)
+            answers.push_back(manager.GetClients(command.hotel));
+        else if (command.type == CommandType::ROOMS)
+            answers.push_back(manager.GetRooms(command.hotel));
+    }
+    return answers;
+}
+
+// Runs the commands through a PartitionedBookingProcessor and reads back
+// what it wrote; with finish == false the processor is destroyed without
+// Finish.
+vector<uint64_t> ProcessPartitioned(const vector<Command>& commands, size_t shard_count, bool finish = true) {
+    FILE* output = tmpfile();
+    ASSERT(output != nullptr);
+    {
+        AnswerWriter writer(fileno(output));
+        PartitionedBookingProcessor processor(shard_count, writer);
+        for (const Command& command : commands)
+            processor.Process(command);
+        if (finish)
+            processor.Finish();
+    }
+
+    vector<uint64_t> answers;
+    rewind(output);
+    for (unsigned long long answer; fscanf(output, "%llu", &answer) == 1;)
+        answers.push_back(answer);
+    fclose(output);
+    return answers;
+}
+
+void TestPartitionedBookingProcessor() {
+    vector<string> hotels;
+    for (size_t hotel = 0; hotel < 11; ++hotel)
+        hotels.push_back("hotel" + to_string(hotel));
+
+    // Spans several answer batches and many times a shard queue's capacity.
+    mt19937_64 rng(3);
+    const vector<Command> commands = GenerateCommands(rng, hotels, 60000);
+    const vector<uint64_t> expected = ProcessSequentially(commands);
+    for (size_t shard_count : {1, 2, 3, 4})
+        ASSERT_EQUAL(ProcessPartitioned(commands, shard_count), expected);
+
+    // Destroying the processor right after a burst lets the shards drain their
+    // queues and stop without hanging. Without Finish only the batches
+    // already closed get their answers written.
+    vector<Command> bookings;
+    for (const Command& command : commands) {
+        if (command.type == CommandType::BOOK)
+            bookings.push_back(command);
+    }
+    for (size_t shard_count : {1, 3}) {
+        ASSERT(ProcessPartitioned(bookings, shard_count, false).empty());
+        ASSERT(ProcessPartitioned(commands, shard_count, false).size() < expected.size());
+    }
+
+    // Finish right after a burst waits for every booking before the queries.
+    vector<Command> burst = bookings;
+    Command query;
+    query.hotel = hotels[0];
+    query.type = CommandType::ROOMS;
+    burst.push_back(query);
+    query.type = CommandType::CLIENTS;
+    burst.push_back(query);
+    ASSERT_EQUAL(ProcessPartitioned(burst, 3), ProcessSequentially(burst));
+}
+
+void AssertSameWindows(const HotelManager& expected, const HotelManager& actual, size_t hotel_count,
+                       size_t window_count) {
+    for (size_t hotel = 0; hotel <= hotel_count; ++hotel) {
+        const string name = "hotel" + to_string(hotel);
+        for (size_t window = 0; window < window_count; ++window) {
+            ASSERT_EQUAL(actual.GetClients(name, window), expected.GetClients(name, window));
+            ASSERT_EQUAL(actual.GetRooms(name, window), expected.GetRooms(name, window));
+        }
+    }
+}
+
+// A manager restored from a snapshot answers like the live one, right away
+// and after both take the same further bookings.
+void TestSnapshotRoundTrip() {
+    const auto path = filesystem::temp_directory_path() / ("booking_snapshot_" + to_string(random_device()()));
+    const vector<int64_t> window_lengths = {HotelManager::SECONDS_IN_DAY, HotelManager::SECONDS_IN_HOUR,
+                                            HotelManager::SECONDS_IN_WEEK};
+    const size_t hotel_count = 5;
+
+    mt19937_64 rng(7);
+    int64_t time = 0;
+    auto book = [&](HotelManager& manager, mt19937_64& events) {
+        time += events() % 600;
+        const int client_id = events() % 50;
+        manager.Book(time, "hotel" + to_string(events() % hotel_count), client_id, 1 + events() % 3);
+    };
+
+    HotelManager live(window_lengths);
+    for (size_t i = 0; i < 5000; ++i)
+        book(live, rng);
+
+    {
+        // The first save is held until the test releases it.
+        promise<void> release;
+        shared_future<void> released = release.get_future().share();
+        size_t saves = 0;
+        SnapshotWriter writer(path.string(), [&](const HotelManagerSnapshot& snapshot, const string& save_path) {
+            if (saves++ == 0)
+                released.wait();
+            SaveSnapshot(snapshot, save_path);
+        });
+        size_t captures = 0;
+        auto capture = [&] {
+            ++captures;
+            return live.CaptureSnapshot();
+        };
+
+        // A writer still busy with the first save must not capture again. The
+        // save is released before asserting, so a failure cannot hang the
+        // writer's destructor.
+        const bool started = writer.TrySave(capture);
+        bool restarted = false;
+        for (size_t attempt = 0; attempt < 3; ++attempt)
+            restarted = writer.TrySave(capture) || restarted;
+        const size_t busy_captures = captures;
+
+        release.set_value();
+        writer.Wait();
+        ASSERT(started);
+        ASSERT(!restarted);
+        ASSERT_EQUAL(busy_captures, 1u);
+        ASSERT(writer.TrySave(capture));
+        ASSERT_EQUAL(captures, 2u);
+        writer.Wait();
+        ASSERT_EQUAL(saves, 2u);
+    }
+    ASSERT(!filesystem::exists(path.string() + ".tmp"));
+
+    HotelManager restored = HotelManager::LoadSnapshot(path.string());
+    filesystem::remove(path);
+    AssertSameWindows(live, restored, hotel_count, window_lengths.size());
+
+    const int64_t saved_time = time;
+    mt19937_64 live_events(8);
+    for (size_t i = 0; i < 3000; ++i)
+        book(live, live_events);
+    time = saved_time;
+    mt19937_64 restored_events(8);
+    for (size_t i = 0; i < 3000; ++i)
+        book(restored, restored_events);
+    AssertSameWindows(live, restored, hotel_count, window_lengths.size());
+}
+
+int main() {
+    TestRunner tr;
+    RUN_TEST(tr, TestBookingHistoryRandom);
+    RUN_TEST(tr, TestMaxAggregate);
+    RUN_TEST(tr, TestCommandReader);
+    RUN_TEST(tr, TestSpscQueue);
+    RUN_TEST(tr, TestPartitionedBookingProcessor);
+    RUN_TEST(tr, TestSnapshotRoundTrip);
+    return 0;
+}
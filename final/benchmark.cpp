@@ -0,0 +1,395 @@
+#include "search_server.h"
+#include "parse.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+struct BenchmarkConfig {
+    size_t document_count = 5'000;
+    size_t words_per_document = 100;
+    size_t query_count = 5'000;
+    size_t words_per_query = 4;
+    size_t vocabulary_size = 20'000;
+    double zipf_exponent = 1.0;
+    size_t max_threads = 4;
+    size_t shard_count = 1;
+    uint64_t seed = 42;
+};
+
+class ZipfGenerator {
+public:
+    ZipfGenerator(size_t n, double exponent) : cdf(n) {
+        double sum = 0;
+        for (size_t rank = 0; rank < n; ++rank) {
+            sum += 1.0 / pow(rank + 1, exponent);
+            cdf[rank] = sum;
+        }
+        for (auto& value : cdf)
+            value /= sum;
+    }
+
+    // std::*_distribution output is implementation-defined, so sampling is done
+    // by hand on top of mt19937_64 to keep corpora identical across toolchains.
+    size_t operator()(mt19937_64& rng) const {
+        const double u = (rng() >> 11) * 0x1.0p-53;
+        const size_t rank = upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return min(rank, cdf.size() - 1);
+    }
+
+private:
+    vector<double> cdf;
+};
+
+string MakeWord(size_t rank) {
+    string word;
+    do {
+        word.push_back('a' + rank % 26);
+        rank /= 26;
+    } while (rank > 0);
+    return word;
+}
+
+vector<string> GenerateLines(const vector<string>& vocabulary, const ZipfGenerator& zipf,
+                             size_t line_count, size_t words_per_line, mt19937_64& rng) {
+    vector<string> lines(line_count);
+
+    for (auto& line : lines) {
+        for (size_t i = 0; i < words_per_line; ++i) {
+            if (i > 0)
+                line.push_back(' ');
+            line += vocabulary[zipf(rng)];
+        }
+    }
+
+    return lines;
+}
+
+struct Workload {
+    string documents;
+    string updated_documents;
+    string queries;
+};
+
+Workload GenerateWorkload(const BenchmarkConfig& config) {
+    vector<string> vocabulary(config.vocabulary_size);
+    for (size_t rank = 0; rank < vocabulary.size(); ++rank)
+        vocabulary[rank] = MakeWord(rank);
+
+    ZipfGenerator zipf(config.vocabulary_size, config.zipf_exponent);
+    mt19937_64 rng(config.seed);
+
+    Workload workload;
+    workload.documents = Join('\n', GenerateLines(vocabulary, zipf, config.document_count,
+                                                  config.words_per_document, rng));
+    workload.updated_documents = Join('\n', GenerateLines(vocabulary, zipf, config.document_count,
+                                                          config.words_per_document, rng));
+    workload.queries = Join('\n', GenerateLines(vocabulary, zipf, config.query_count,
+                                                config.words_per_query, rng));
+    return workload;
+}
+
+void Report(const string& name, size_t threads, size_t items, steady_clock::duration elapsed) {
+    const double ms = duration<double, milli>(elapsed).count();
+    const double per_second = ms > 0 ? items * 1000.0 / ms : 0;
+
+    cout << "{\"benchmark\": \"" << name << "\""
+         << ", \"threads\": " << threads
+         << ", \"items\": " << items
+         << ", \"ms\": " << ms
+         << ", \"items_per_sec\": " << per_second << "}" << endl;
+}
+
+void CheckOutputs(const vector<ostringstream>& outputs, size_t query_count, const string& reference) {
+    for (const auto& output : outputs) {
+        const string result = output.str();
+        const size_t lines = count(result.begin(), result.end(), '\n');
+        if (lines != query_count)
+            throw runtime_error("expected " + to_string(query_count) + " result lines, got " + to_string(lines));
+        if (!reference.empty() && result != reference)
+            throw runtime_error("concurrent streams produced different results");
+    }
+}
+
+string BenchmarkBuild(const BenchmarkConfig& config, const Workload& workload) {
+    istringstream documents(workload.documents);
+    istringstream queries(workload.queries);
+    ostringstream output;
+
+    const auto start = steady_clock::now();
+    {
+        SearchServer srv(documents, config.shard_count);
+        Report("build", srv.GetBuildWorkerCount(), config.document_count, steady_clock::now() - start);
+        srv.AddQueriesStream(queries, output);
+    }
+
+    return output.str();
+}
+
+deque<string> SplitDocuments(const string& documents) {
+    deque<string> result;
+    for (string_view document : SplitBy(documents, '\n'))
+        result.emplace_back(document);
+    return result;
+}
+
+// BuildFrozen caps its workers by corpus size, so the documents are repeated
+// until max_threads workers all get their share, and each row reports the
+// workers that actually ran.
+void BenchmarkIndexBuild(const BenchmarkConfig& config, const Workload& workload) {
+    const deque<string> corpus = SplitDocuments(workload.documents);
+    const size_t document_count = max(corpus.size(),
+                                      config.max_threads * InvertedIndex::MIN_BUILD_DOCUMENTS_PER_WORKER);
+    auto make_documents = [&corpus, document_count] {
+        deque<string> documents;
+        for (size_t i = 0; i < document_count; ++i)
+            documents.push_back(corpus[i % corpus.size()]);
+        return documents;
+    };
+
+    {
+        deque<string> documents = make_documents();
+        const auto start = steady_clock::now();
+        InvertedIndex index(move(documents));
+        index.Freeze();
+        Report("index_build_map_freeze", 1, document_count, steady_clock::now() - start);
+    }
+
+    for (size_t threads = 1; threads <= config.max_threads; ++threads) {
+        deque<string> documents = make_documents();
+        const auto start = steady_clock::now();
+        InvertedIndex::BuildFrozen(move(documents), threads);
+        Report("index_build_two_pass", InvertedIndex::GetBuildWorkerCount(document_count, threads),
+               document_count, steady_clock::now() - start);
+    }
+}
+
+void BenchmarkQueries(const BenchmarkConfig& config, const Workload& workload, const string& reference) {
+    for (size_t threads = 1; threads <= config.max_threads; ++threads) {
+        istringstream documents(workload.documents);
+        SearchServer srv(documents, config.shard_count);
+
+        vector<istringstream> inputs;
+        for (size_t i = 0; i < threads; ++i)
+            inputs.emplace_back(workload.queries);
+        vector<ostringstream> outputs(threads);
+
+        const auto start = steady_clock::now();
+        for (size_t i = 0; i < threads; ++i)
+            srv.AddQueriesStream(inputs[i], outputs[i]);
+        srv.Wait();
+        Report("query", threads, threads * config.query_count, steady_clock::now() - start);
+
+        CheckOutputs(outputs, config.query_count, reference);
+    }
+}
+
+void BenchmarkUpdateDuringQuery(const BenchmarkConfig& config, const Workload& workload) {
+    const size_t threads = config.max_threads;
+
+    istringstream documents(workload.documents);
+    istringstream updated_documents(workload.updated_documents);
+    SearchServer srv(documents, config.shard_count);
+
+    vector<istringstream> inputs;
+    for (size_t i = 0; i < threads; ++i)
+        inputs.emplace_back(workload.queries);
+    vector<ostringstream> outputs(threads);
+
+    const auto start = steady_clock::now();
+    for (size_t i = 0; i < threads; ++i) {
+        srv.AddQueriesStream(inputs[i], outputs[i]);
+        if (i == threads / 2)
+            srv.UpdateDocumentBase(updated_documents);
+    }
+    srv.Wait();
+    Report("update_during_query", threads, threads * config.query_count, steady_clock::now() - start);
+
+    CheckOutputs(outputs, config.query_count, "");
+}
+
+template <typename GetAccess>
+size_t ReadIndex(GetAccess get_access, const vector<string_view>& words, size_t rounds) {
+    size_t postings = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        for (string_view word : words) {
+            auto access = get_access();
+            postings += access.ref_to_value.Lookup(word).size();
+        }
+    }
+    return postings;
+}
+
+void BenchmarkSynchronizedReads(const BenchmarkConfig& config, const Workload& workload) {
+    const size_t rounds = 20;
+    const vector<string_view> words = SplitIntoWords(workload.queries);
+
+    istringstream documents(workload.documents);
+    InvertedIndex index(documents);
+    index.Freeze();
+    Synchronized<InvertedIndex> synchronized_index(move(index));
+
+    auto exclusive = [&synchronized_index] { return synchronized_index.GetAccess(); };
+    auto shared = [&synchronized_index] { return synchronized_index.GetReadAccess(); };
+
+    for (size_t threads = 1; threads <= config.max_threads; ++threads) {
+        for (bool use_shared : {false, true}) {
+            vector<future<size_t>> readers;
+            const auto start = steady_clock::now();
+            for (size_t i = 0; i < threads; ++i) {
+                if (use_shared)
+                    readers.push_back(async(launch::async, ReadIndex<decltype(shared)>, shared, cref(words), rounds));
+                else
+                    readers.push_back(async(launch::async, ReadIndex<decltype(exclusive)>, exclusive, cref(words), rounds));
+            }
+            for (auto& reader : readers)
+                reader.get();
+
+            Report(use_shared ? "synchronized_shared_read" : "synchronized_exclusive_read",
+                   threads, threads * rounds * words.size(), steady_clock::now() - start);
+        }
+    }
+}
+
+size_t CountCandidates(FindGreaterFunc find_greater, const vector<size_t>& counts, size_t threshold) {
+    size_t candidates = 0;
+    const size_t* last = counts.data() + counts.size();
+    for (const size_t* it = find_greater(counts.data(), last, threshold); it != last;
+         it = find_greater(it + 1, last, threshold))
+        ++candidates;
+    return candidates;
+}
+
+void BenchmarkTopKFilter(const BenchmarkConfig& config) {
+    const size_t rounds = 200;
+    const size_t threshold = 16;
+
+    // Hit counters of a typical query: mostly zeros with a Zipfian tail, filtered
+    // against a top-K minimum that only a small share of documents exceeds.
+    ZipfGenerator zipf(64, config.zipf_exponent);
+    mt19937_64 rng(config.seed);
+    vector<size_t> counts(config.document_count * 10);
+    for (auto& count : counts)
+        count = (rng() % 8 == 0) ? zipf(rng) : 0;
+
+    const pair<string, FindGreaterFunc> kernels[] = {
+            {"top_k_filter_scalar", FindGreaterScalar},
+            {string("top_k_filter_") + GetSimdLevel(), FindGreater},
+    };
+
+    size_t expected = CountCandidates(FindGreaterScalar, counts, threshold);
+    for (const auto& [name, kernel] : kernels) {
+        size_t candidates = 0;
+        const auto start = steady_clock::now();
+        for (size_t round = 0; round < rounds; ++round)
+            candidates += CountCandidates(kernel, counts, threshold);
+        Report(name, 1, rounds * counts.size(), steady_clock::now() - start);
+
+        if (candidates != rounds * expected)
+            throw runtime_error(name + " disagrees with the scalar filter");
+    }
+}
+
+void BenchmarkHitAccumulation(const BenchmarkConfig& config) {
+    const size_t rounds = 200;
+
+    // A run of a term present in every document, added to a query's counters.
+    mt19937_64 rng(config.seed);
+    vector<uint32_t> hit_counts(config.document_count * 10);
+    for (auto& hit_count : hit_counts)
+        hit_count = 1 + rng() % 4;
+
+    const pair<string, AddHitCountsFunc> kernels[] = {
+            {"hit_accumulation_scalar", AddHitCountsScalar},
+            {string("hit_accumulation_") + GetSimdLevel(), AddHitCounts},
+    };
+
+    vector<size_t> expected(hit_counts.size());
+    for (size_t round = 0; round < rounds; ++round)
+        AddHitCountsScalar(expected.data(), hit_counts.data(), hit_counts.size());
+
+    for (const auto& [name, kernel] : kernels) {
+        vector<size_t> counters(hit_counts.size());
+        const auto start = steady_clock::now();
+        for (size_t round = 0; round < rounds; ++round)
+            kernel(counters.data(), hit_counts.data(), hit_counts.size());
+        Report(name, 1, rounds * hit_counts.size(), steady_clock::now() - start);
+
+        if (counters != expected)
+            throw runtime_error(name + " disagrees with the scalar accumulation");
+    }
+}
+
+const string USAGE = "usage: final_benchmark [--docs N] [--words-per-doc N] [--queries N] [--words-per-query N] "
+                     "[--vocabulary N] [--zipf S] [--threads N] [--shards N] [--seed N]";
+
+BenchmarkConfig ParseArguments(int argc, char* argv[]) {
+    BenchmarkConfig config;
+
+    if (argc % 2 == 0)
+        throw invalid_argument("option " + string(argv[argc - 1]) + " needs a value\n" + USAGE);
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const string_view name = argv[i];
+        const string value = argv[i + 1];
+
+        if (name == "--docs")
+            config.document_count = stoul(value);
+        else if (name == "--words-per-doc")
+            config.words_per_document = stoul(value);
+        else if (name == "--queries")
+            config.query_count = stoul(value);
+        else if (name == "--words-per-query")
+            config.words_per_query = stoul(value);
+        else if (name == "--vocabulary")
+            config.vocabulary_size = stoul(value);
+        else if (name == "--zipf")
+            config.zipf_exponent = stod(value);
+        else if (name == "--threads")
+            config.max_threads = stoul(value);
+        else if (name == "--shards")
+            config.shard_count = stoul(value);
+        else if (name == "--seed")
+            config.seed = stoull(value);
+        else
+            throw invalid_argument("unknown option " + string(name) + "\n" + USAGE);
+    }
+
+    if (config.document_count == 0 || config.query_count == 0 || config.vocabulary_size == 0 || config.max_threads == 0)
+        throw invalid_argument("--docs, --queries, --vocabulary and --threads must be positive");
+
+    return config;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        const BenchmarkConfig config = ParseArguments(argc, argv);
+        const Workload workload = GenerateWorkload(config);
+
+        const string reference = BenchmarkBuild(config, workload);
+        BenchmarkIndexBuild(config, workload);
+        BenchmarkQueries(config, workload, reference);
+        BenchmarkUpdateDuringQuery(config, workload);
+        BenchmarkTopKFilter(config);
+        BenchmarkHitAccumulation(config);
+        BenchmarkSynchronizedReads(config, workload);
+    } catch (exception& e) {
+        cerr << "benchmark failed: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
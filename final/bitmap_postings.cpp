@@ -0,0 +1,67 @@
+#include "bitmap_postings.h"
+
+#include <limits>
+#include <stdexcept>
+
+uint32_t BitmapPostings::CheckHitCount(size_t hit_count) {
+    if (hit_count > numeric_limits<uint32_t>::max())
+        throw overflow_error("hit count does not fit bitmap postings");
+    return hit_count;
+}
+
+void BitmapPostings::PushBack(size_t docid, size_t hit_count) {
+    CheckHitCount(hit_count);
+
+    const size_t key = docid >> CHUNK_BITS;
+    const size_t low = docid & ((1 << CHUNK_BITS) - 1);
+
+    if (containers.empty() || containers.back().key != key)
+        containers.push_back({key, 0, hit_counts.size(), array_values.size(), false});
+
+    Container& container = containers.back();
+    if (container.is_bitmap) {
+        bitmap_words[container.data_offset + low / 64] |= uint64_t(1) << (low % 64);
+    } else {
+        array_values.push_back(low);
+        if (container.cardinality + 1 > ARRAY_MAX_SIZE)
+            ConvertToBitmap(container);
+    }
+
+    ++container.cardinality;
+    hit_counts.push_back(hit_count);
+}
+
+// Only the last container can still be growing, so its array values are
+// always the tail of array_values.
+void BitmapPostings::ConvertToBitmap(Container& container) {
+    const size_t bitmap_offset = bitmap_words.size();
+    bitmap_words.resize(bitmap_offset + BITMAP_WORDS, 0);
+
+    for (size_t i = container.data_offset; i < array_values.size(); ++i)
+        bitmap_words[bitmap_offset + array_values[i] / 64] |= uint64_t(1) << (array_values[i] % 64);
+
+    array_values.resize(container.data_offset);
+    container.data_offset = bitmap_offset;
+    container.is_bitmap = true;
+}
+
+void BitmapPostings::ShrinkToFit() {
+    containers.shrink_to_fit();
+    bitmap_words.shrink_to_fit();
+    array_values.shrink_to_fit();
+    hit_counts.shrink_to_fit();
+}
+
+size_t BitmapPostings::GetUsedBytes() const {
+    return containers.size() * sizeof(Container)
+           + bitmap_words.size() * sizeof(uint64_t)
+           + array_values.size() * sizeof(uint16_t)
+           + hit_counts.size() * sizeof(uint32_t);
+}
+
+size_t BitmapPostings::GetReservedBytes() const {
+    return containers.capacity() * sizeof(Container)
+           + bitmap_words.capacity() * sizeof(uint64_t)
+           + array_values.capacity() * sizeof(uint16_t)
+           + hit_counts.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Roaring-style posting list for terms present in a large share of documents:
+// docids are split into 64K chunks, each stored as a sorted uint16 array or,
+// once it holds more than ARRAY_MAX_SIZE docids, as a 65536-bit bitmap.
+// Hit counts live in a side array in docid order.
+class BitmapPostings {
+public:
+    static const size_t ARRAY_MAX_SIZE = 4096;
+
+    // Docids must be pushed in strictly ascending order.
+    void PushBack(size_t docid, size_t hit_count);
+
+    // Replaces the contents with the postings in [first, last), which expose
+    // docid and hit_count and are sorted by docid. A counting pass sizes every
+    // buffer exactly, so the fill does not reallocate.
+    template <typename Iterator>
+    void Assign(Iterator first, Iterator last);
+
+    void ShrinkToFit();
+
+    size_t size() const {
+        return hit_counts.size();
+    }
+
+    size_t GetUsedBytes() const;
+    size_t GetReservedBytes() const;
+
+    template <typename Callback>
+    void ForEach(Callback callback) const {
+        ForEach(callback, [] { return false; });
+    }
+
+    // Calls should_stop before every 64K chunk; returns false if it stopped early.
+    template <typename Callback, typename ShouldStop>
+    bool ForEach(Callback callback, ShouldStop should_stop) const {
+        auto run_callback = [&callback](size_t first_docid, const uint32_t* hits, size_t count) {
+            for (size_t i = 0; i < count; ++i)
+                callback(first_docid + i, hits[i]);
+        };
+        return ForEachWithRuns(callback, run_callback, should_stop);
+    }
+
+    // Same, but every run of full bitmap words, i.e. consecutive docids that
+    // all contain the term, goes to run_callback(first_docid, hit_counts,
+    // count) at once, so callers can add its hit counts without per-docid work.
+    template <typename Callback, typename RunCallback, typename ShouldStop>
+    bool ForEachWithRuns(Callback callback, RunCallback run_callback, ShouldStop should_stop) const {
+        for (const Container& container : containers) {
+            if (should_stop())
+                return false;
+
+            const size_t base = container.key << CHUNK_BITS;
+            const uint32_t* hits = hit_counts.data() + container.hits_offset;
+
+            if (container.is_bitmap) {
+                const uint64_t* words = bitmap_words.data() + container.data_offset;
+                for (size_t i = 0; i < BITMAP_WORDS;) {
+                    if (words[i] == FULL_WORD) {
+                        size_t run_end = i + 1;
+                        while (run_end < BITMAP_WORDS && words[run_end] == FULL_WORD)
+                            ++run_end;
+
+                        const size_t count = (run_end - i) * 64;
+                        run_callback(base + i * 64, hits, count);
+                        hits += count;
+                        i = run_end;
+                        continue;
+                    }
+
+                    for (uint64_t word = words[i]; word != 0; word &= word - 1)
+                        callback(base + i * 64 + __builtin_ctzll(word), *hits++);
+                    ++i;
+                }
+            } else {
+                const uint16_t* values = array_values.data() + container.data_offset;
+                for (size_t i = 0; i < container.cardinality; ++i)
+                    callback(base + values[i], *hits++);
+            }
+        }
+
+        return true;
+    }
+
+private:
+    static const size_t CHUNK_BITS = 16;
+    static const size_t BITMAP_WORDS = (1 << CHUNK_BITS) / 64;
+    static const uint64_t FULL_WORD = ~uint64_t(0);
+
+    struct Container {
+        size_t key;
+        size_t cardinality;
+        size_t hits_offset;
+        size_t data_offset;
+        bool is_bitmap;
+    };
+
+    vector<Container> containers;
+    vector<uint64_t> bitmap_words;
+    vector<uint16_t> array_values;
+    vector<uint32_t> hit_counts;
+
+    void ConvertToBitmap(Container& container);
+    static uint32_t CheckHitCount(size_t hit_count);
+
+    template <typename Iterator>
+    static Iterator ChunkEnd(Iterator first, Iterator last) {
+        const size_t key = first->docid >> CHUNK_BITS;
+        while (first != last && first->docid >> CHUNK_BITS == key)
+            ++first;
+        return first;
+    }
+};
+
+template <typename Iterator>
+void BitmapPostings::Assign(Iterator first, Iterator last) {
+    size_t container_count = 0;
+    size_t bitmap_count = 0;
+    size_t array_count = 0;
+    size_t hit_count = 0;
+    for (Iterator it = first; it != last;) {
+        const Iterator chunk_end = ChunkEnd(it, last);
+        const size_t cardinality = chunk_end - it;
+        ++container_count;
+        if (cardinality > ARRAY_MAX_SIZE)
+            ++bitmap_count;
+        else
+            array_count += cardinality;
+        hit_count += cardinality;
+        it = chunk_end;
+    }
+
+    containers.clear();
+    bitmap_words.clear();
+    array_values.clear();
+    hit_counts.clear();
+    containers.reserve(container_count);
+    bitmap_words.reserve(bitmap_count * BITMAP_WORDS);
+    array_values.reserve(array_count);
+    hit_counts.reserve(hit_count);
+
+    for (Iterator it = first; it != last;) {
+        const Iterator chunk_end = ChunkEnd(it, last);
+        const size_t cardinality = chunk_end - it;
+        const bool is_bitmap = cardinality > ARRAY_MAX_SIZE;
+        containers.push_back({it->docid >> CHUNK_BITS, cardinality, hit_counts.size(),
+                              is_bitmap ? bitmap_words.size() : array_values.size(), is_bitmap});
+        if (is_bitmap)
+            bitmap_words.resize(bitmap_words.size() + BITMAP_WORDS, 0);
+
+        uint64_t* words = bitmap_words.data() + containers.back().data_offset;
+        for (; it != chunk_end; ++it) {
+            const size_t low = it->docid & ((1 << CHUNK_BITS) - 1);
+            if (is_bitmap)
+                words[low / 64] |= uint64_t(1) << (low % 64);
+            else
+                array_values.push_back(low);
+            hit_counts.push_back(CheckHitCount(it->hit_count));
+        }
+    }
+}
@@ -0,0 +1,359 @@
+#include "search_server.h"
+#include "parse.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Mirrors the limits baked into SearchServer.
+const size_t MAX_RESULTS = 5;
+const size_t MAX_PREFIX_TERMS = 64;
+
+struct TestCase {
+    vector<string> docs;
+    vector<string> queries;
+};
+
+// Straightforward evaluation of the ranking rules, used as the oracle: hits of
+// every query word are summed per document, "w*" sums the first 64 indexed
+// terms starting with "w" in dictionary order, ties go to the lower docid and
+// documents without hits are not reported.
+string ReferenceSearch(const TestCase& test_case) {
+    vector<map<string_view, size_t>> doc_words(test_case.docs.size());
+    map<string_view, size_t> dictionary;
+    for (size_t docid = 0; docid < test_case.docs.size(); ++docid) {
+        for (string_view word : SplitIntoWords(test_case.docs[docid])) {
+            ++doc_words[docid][word];
+            ++dictionary[word];
+        }
+    }
+
+    ostringstream output;
+    for (const string& query : test_case.queries) {
+        vector<string_view> terms;
+        for (string_view word : SplitIntoWords(query)) {
+            if (word.size() > 1 && word.back() == '*') {
+                word.remove_suffix(1);
+                size_t expanded = 0;
+                for (auto it = dictionary.lower_bound(word);
+                     it != dictionary.end() && it->first.substr(0, word.size()) == word && expanded < MAX_PREFIX_TERMS;
+                     ++it, ++expanded)
+                    terms.push_back(it->first);
+            } else {
+                terms.push_back(word);
+            }
+        }
+
+        vector<pair<size_t, size_t>> ranking;
+        for (size_t docid = 0; docid < test_case.docs.size(); ++docid) {
+            size_t hit_count = 0;
+            for (string_view term : terms) {
+                auto it = doc_words[docid].find(term);
+                if (it != doc_words[docid].end())
+                    hit_count += it->second;
+            }
+            if (hit_count > 0)
+                ranking.push_back({hit_count, docid});
+        }
+
+        sort(ranking.begin(), ranking.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first != rhs.first ? lhs.first > rhs.first : lhs.second < rhs.second;
+        });
+        ranking.resize(min(ranking.size(), MAX_RESULTS));
+
+        output << query << ':';
+        for (const auto& [hit_count, docid] : ranking)
+            output << " {docid: " << docid << ", hitcount: " << hit_count << '}';
+        output << '\n';
+    }
+
+    return output.str();
+}
+
+string JoinLines(const vector<string>& lines) {
+    string result;
+    for (const string& line : lines)
+        result += line + '\n';
+    return result;
+}
+
+string RunQueries(SearchServer& srv, const TestCase& test_case, QueryOptions options = {}) {
+    istringstream queries_input(JoinLines(test_case.queries));
+    ostringstream queries_output;
+    srv.AddQueriesStream(queries_input, queries_output, options);
+    srv.Wait();
+    return queries_output.str();
+}
+
+struct Mode {
+    string name;
+    function<string(const TestCase&)> run;
+};
+
+vector<Mode> MakeModes(const filesystem::path& journal_directory) {
+    vector<Mode> modes;
+
+    for (size_t shard_count : {1, 2, 3, 7}) {
+        modes.push_back({"shards=" + to_string(shard_count), [shard_count](const TestCase& test_case) {
+            istringstream docs_input(JoinLines(test_case.docs));
+            SearchServer srv(docs_input, shard_count);
+            return RunQueries(srv, test_case);
+        }});
+    }
+
+    // Shard counts are also compared with each other, so a sharding bug shows
+    // up even where it happens to agree with the oracle.
+    modes.push_back({"shard_counts_agree", [](const TestCase& test_case) {
+        string first_output;
+        for (size_t shard_count : {1, 4, 5, 8}) {
+            istringstream docs_input(JoinLines(test_case.docs));
+            SearchServer srv(docs_input, shard_count);
+            const string output = RunQueries(srv, test_case);
+            if (shard_count == 1)
+                first_output = output;
+            else if (output != first_output)
+                return "shards=1:\n" + first_output + "shards=" + to_string(shard_count) + ":\n" + output;
+        }
+        return first_output;
+    }});
+
+    modes.push_back({"generous_budget", [](const TestCase& test_case) {
+        istringstream docs_input(JoinLines(test_case.docs));
+        SearchServer srv(docs_input, 2);
+        QueryOptions options;
+        options.query_budget = chrono::hours(1);
+        return RunQueries(srv, test_case, options);
+    }});
+
+    modes.push_back({"direct_api", [](const TestCase& test_case) {
+        istringstream docs_input(JoinLines(test_case.docs));
+        SearchServer srv(docs_input, 3);
+        const string queries = JoinLines(test_case.queries);
+        vector<SearchResult> results;
+        srv.Search(string_view(queries), results);
+
+        ostringstream output;
+        for (size_t i = 0; i < test_case.queries.size(); ++i) {
+            output << test_case.queries[i] << ':';
+            for (const auto& [docid, hit_count] : results[i].documents)
+                output << " {docid: " << docid << ", hitcount: " << hit_count << '}';
+            output << '\n';
+        }
+        return output.str();
+    }});
+
+    modes.push_back({"incremental_add", [](const TestCase& test_case) {
+        SearchServer srv;
+        // Every append rebuilds the shard it lands in, so big corpora go in
+        // bigger batches to keep the mode linear.
+        const size_t batch_size = max<size_t>(97, test_case.docs.size() / 16);
+        vector<istringstream> inputs;
+        for (size_t first = 0; first < test_case.docs.size(); first += batch_size) {
+            const auto last = test_case.docs.begin() + min(test_case.docs.size(), first + batch_size);
+            inputs.emplace_back(JoinLines(vector<string>(test_case.docs.begin() + first, last)));
+        }
+        for (auto& input : inputs)
+            srv.AddDocuments(input);
+        srv.Wait();
+        return RunQueries(srv, test_case);
+    }});
+
+    modes.push_back({"journal_recovery", [journal_directory](const TestCase& test_case) {
+        filesystem::remove_all(journal_directory);
+        {
+            SearchServer srv(journal_directory.string());
+            istringstream docs_input(JoinLines(test_case.docs));
+            srv.UpdateDocumentBase(docs_input);
+            srv.Wait();
+        }
+        SearchServer srv(journal_directory.string(), 3);
+        return RunQueries(srv, test_case);
+    }});
+
+    return modes;
+}
+
+optional<string> FindDivergence(const TestCase& test_case, const Mode& mode) {
+    const string expected = ReferenceSearch(test_case);
+    const string actual = mode.run(test_case);
+    if (actual == expected)
+        return nullopt;
+    return "expected:\n" + expected + "actual:\n" + actual;
+}
+
+// Greedy delta debugging: drop chunks of documents and queries, then single
+// words, for as long as the mode still disagrees with the reference. A big
+// corpus can take hours to shrink all the way, so after a minute the smallest
+// case found so far is returned.
+TestCase Shrink(TestCase test_case, const Mode& mode) {
+    const auto deadline = chrono::steady_clock::now() + chrono::minutes(1);
+    auto diverges = [&] {
+        return chrono::steady_clock::now() < deadline && FindDivergence(test_case, mode);
+    };
+
+    auto try_remove_items = [&](vector<string>& items) {
+        bool changed = false;
+        for (size_t chunk = max<size_t>(items.size() / 2, 1); chunk > 0; chunk /= 2) {
+            for (size_t first = 0; first < items.size();) {
+                vector<string> saved = items;
+                items.erase(items.begin() + first, items.begin() + min(items.size(), first + chunk));
+                if (diverges()) {
+                    changed = true;
+                } else {
+                    items = move(saved);
+                    first += chunk;
+                }
+            }
+        }
+        return changed;
+    };
+
+    auto try_remove_words = [&](vector<string>& lines) {
+        bool changed = false;
+        for (string& line : lines) {
+            vector<string_view> words = SplitIntoWords(line);
+            for (size_t i = 0; i < words.size();) {
+                vector<string_view> candidate = words;
+                candidate.erase(candidate.begin() + i);
+
+                string saved = line;
+                string shrunk;
+                for (string_view word : candidate)
+                    shrunk += (shrunk.empty() ? "" : " ") + string(word);
+                line = shrunk;
+
+                if (diverges()) {
+                    changed = true;
+                    words = SplitIntoWords(line);
+                } else {
+                    line = move(saved);
+                    words = SplitIntoWords(line);
+                    ++i;
+                }
+            }
+        }
+        return changed;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = try_remove_items(test_case.queries);
+        changed = try_remove_items(test_case.docs) || changed;
+        changed = try_remove_words(test_case.queries) || changed;
+        changed = try_remove_words(test_case.docs) || changed;
+    }
+
+    return test_case;
+}
+
+TestCase GenerateTestCase(mt19937_64& rng) {
+    // Small vocabularies with skewed frequencies give many ties and shared
+    // prefixes.
+    // One case in four instead uses 100 to 300 words that all start with "p",
+    // picked uniformly, so "p*" and "pa*" expand past MAX_PREFIX_TERMS.
+    // One in eight of the rest is big enough to give even 8 shards more than
+    // 4096 docids per bitmap chunk, with "all" in every document and "most" in
+    // nearly every one, so bitmap containers and runs of full words are hit.
+    const bool wide_prefix = rng() % 4 == 0;
+    const bool huge = !wide_prefix && rng() % 8 == 0;
+    const size_t vocabulary_size = wide_prefix ? 100 + rng() % 200 : 5 + rng() % 60;
+    vector<string> vocabulary;
+    for (size_t i = 0; i < vocabulary_size; ++i) {
+        string word = wide_prefix ? "p" : "";
+        const size_t length = wide_prefix ? 2 + rng() % 3 : 1 + rng() % 4;
+        for (size_t j = 0; j < length; ++j)
+            word.push_back('a' + rng() % (wide_prefix ? 8 : 4));
+        vocabulary.push_back(word);
+    }
+
+    auto pick_word = [&]() -> const string& {
+        const size_t a = rng() % vocabulary_size;
+        const size_t b = rng() % vocabulary_size;
+        return vocabulary[wide_prefix ? a : min(a, b)];
+    };
+
+    auto make_line = [&](size_t max_words) {
+        string line;
+        const size_t words = rng() % (max_words + 1);
+        for (size_t i = 0; i < words; ++i)
+            line += (i > 0 ? " " : "") + pick_word();
+        return line;
+    };
+
+    TestCase test_case;
+    const size_t doc_count = huge ? 33000 + rng() % 7000
+                             : rng() % 4 == 0 ? 1500 + rng() % 2500
+                             : wide_prefix ? 50 + rng() % 350 : 1 + rng() % 40;
+    for (size_t i = 0; i < doc_count; ++i) {
+        string doc = make_line(12);
+        if (huge)
+            doc = (rng() % 16 ? "all most " : "all ") + doc;
+        test_case.docs.push_back(doc);
+    }
+
+    const size_t query_count = huge ? 1 + rng() % 40 : 1 + rng() % 300;
+    for (size_t i = 0; i < query_count; ++i) {
+        if (!test_case.queries.empty() && rng() % 4 == 0) {
+            test_case.queries.push_back(test_case.queries[rng() % test_case.queries.size()]);
+            continue;
+        }
+
+        string query = make_line(4);
+        if (huge && rng() % 2 == 0) {
+            query += string(query.empty() ? "" : " ") + (rng() % 2 ? "all" : "most");
+        } else if (wide_prefix && rng() % 3 == 0) {
+            query += string(query.empty() ? "" : " ") + (rng() % 2 ? "p*" : "pa*");
+        } else if (!query.empty() && rng() % 5 == 0) {
+            query.resize(query.size() - rng() % min<size_t>(query.size(), 2));
+            if (query.back() != ' ')
+                query.push_back('*');
+        }
+        test_case.queries.push_back(query);
+    }
+
+    return test_case;
+}
+
+int main(int argc, char* argv[]) {
+    const uint64_t seed = argc > 1 ? stoull(argv[1]) : 1;
+    const size_t iterations = argc > 2 ? stoul(argv[2]) : 40;
+
+    const auto journal_directory = filesystem::temp_directory_path()
+                                   / ("search_server_differential_" + to_string(random_device()()));
+    const vector<Mode> modes = MakeModes(journal_directory);
+
+    mt19937_64 rng(seed);
+    int exit_code = 0;
+    for (size_t iteration = 0; iteration < iterations && exit_code == 0; ++iteration) {
+        const TestCase test_case = GenerateTestCase(rng);
+
+        for (const Mode& mode : modes) {
+            if (!FindDivergence(test_case, mode))
+                continue;
+
+            const TestCase reproducer = Shrink(test_case, mode);
+            cerr << "Mode " << mode.name << " diverges from the reference (seed " << seed
+                 << ", iteration " << iteration << ")" << endl
+                 << "documents:" << endl << JoinLines(reproducer.docs)
+                 << "queries:" << endl << JoinLines(reproducer.queries)
+                 << *FindDivergence(reproducer, mode);
+            exit_code = 1;
+            break;
+        }
+    }
+
+    filesystem::remove_all(journal_directory);
+    if (exit_code == 0)
+        cerr << iterations << " iterations, " << modes.size() << " modes: OK" << endl;
+    return exit_code;
+}
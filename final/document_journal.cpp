@@ -0,0 +1,409 @@
+#include "document_journal.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+const uint8_t RECORD_RESET = 1;
+const uint8_t RECORD_APPEND = 2;
+const uint8_t RECORD_SNAPSHOT = 3;
+
+// u64 body size and u32 CRC-32, followed by at least the type byte.
+const size_t RECORD_PREFIX_SIZE = 12;
+const size_t RECORD_HEADER_SIZE = RECORD_PREFIX_SIZE + 1;
+const size_t SNAPSHOT_CHUNK_DOCUMENTS = 4096;
+
+const char* const SNAPSHOT_NAME = "snapshot";
+const char* const SNAPSHOT_TMP_NAME = "snapshot.tmp";
+const char* const LOG_PREFIX = "log.";
+
+uint32_t Crc32(const char* data, size_t size) {
+    static const auto table = [] {
+        array<uint32_t, 256> result{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            result[i] = c;
+        }
+        return result;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+void PutU32(string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+        out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+void PutU64(string& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i)
+        out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+// Document counts and sizes are stored in 32 bits; larger ones are refused
+// before anything is logged rather than written truncated.
+void PutLength(string& out, size_t value) {
+    if (value > numeric_limits<uint32_t>::max())
+        throw length_error("journal record field of " + to_string(value) + " does not fit 32 bits");
+    PutU32(out, static_cast<uint32_t>(value));
+}
+
+void PutRecordPrefix(string& out, const string& body) {
+    PutU64(out, body.size());
+    PutU32(out, Crc32(body.data(), body.size()));
+}
+
+uint64_t GetUInt(const char* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+        value |= uint64_t(static_cast<uint8_t>(data[i])) << (8 * i);
+    return value;
+}
+
+// Record layout: u64 body size, u32 CRC-32 of the body, body = u8 type + payload.
+template <typename It>
+void AppendRecord(string& out, uint8_t type, It first, It last) {
+    string body(1, static_cast<char>(type));
+    PutLength(body, last - first);
+    for (It it = first; it != last; ++it) {
+        PutLength(body, it->size());
+        body += *it;
+    }
+
+    PutRecordPrefix(out, body);
+    out += body;
+}
+
+struct Record {
+    uint8_t type;
+    string_view payload;
+};
+
+// Parses records from data; returns the number of bytes that formed complete,
+// intact records. Anything after that is a torn or corrupted tail.
+template <typename Callback>
+size_t ReadRecords(const string& data, Callback callback) {
+    size_t pos = 0;
+    while (data.size() - pos >= RECORD_HEADER_SIZE) {
+        const uint64_t body_size = GetUInt(data.data() + pos, 8);
+        const uint32_t crc = GetUInt(data.data() + pos + 8, 4);
+        if (body_size == 0 || data.size() - pos - RECORD_PREFIX_SIZE < body_size)
+            break;
+
+        const char* body = data.data() + pos + RECORD_PREFIX_SIZE;
+        if (Crc32(body, body_size) != crc)
+            break;
+
+        callback(Record{static_cast<uint8_t>(body[0]), string_view(body + 1, body_size - 1)});
+        pos += RECORD_PREFIX_SIZE + body_size;
+    }
+    return pos;
+}
+
+void ApplyRecord(const Record& record, deque<string>& documents) {
+    if (record.type == RECORD_RESET)
+        documents.clear();
+    if (record.type != RECORD_RESET && record.type != RECORD_APPEND)
+        return;
+
+    string_view payload = record.payload;
+    auto take = [&payload](size_t size) {
+        if (payload.size() < size)
+            throw runtime_error("malformed journal record");
+        string_view result = payload.substr(0, size);
+        payload.remove_prefix(size);
+        return result;
+    };
+
+    const uint64_t count = GetUInt(take(4).data(), 4);
+    for (uint64_t i = 0; i < count; ++i) {
+        const uint64_t size = GetUInt(take(4).data(), 4);
+        documents.emplace_back(take(size));
+    }
+}
+
+string ReadFile(const fs::path& path) {
+    ifstream input(path, ios::binary);
+    return string(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+}
+
+void ThrowSystemError(const string& what) {
+    throw system_error(errno, generic_category(), what);
+}
+
+void WriteAll(int fd, const string& data) {
+    for (size_t written = 0; written < data.size();) {
+        const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ThrowSystemError("journal write");
+        }
+        written += n;
+    }
+}
+
+void SyncFile(int fd) {
+    if (::fsync(fd) != 0)
+        ThrowSystemError("journal fsync");
+}
+
+void SyncDirectory(const fs::path& directory) {
+    const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        ThrowSystemError("open journal directory");
+    const int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0)
+        ThrowSystemError("fsync journal directory");
+}
+
+int OpenLog(const fs::path& path) {
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        ThrowSystemError("open " + path.string());
+    return fd;
+}
+
+fs::path LogPath(const fs::path& directory, uint64_t generation) {
+    return directory / (LOG_PREFIX + to_string(generation));
+}
+
+vector<uint64_t> ListLogGenerations(const fs::path& directory) {
+    vector<uint64_t> generations;
+    for (const auto& entry : fs::directory_iterator(directory)) {
+        const string name = entry.path().filename().string();
+        if (name.rfind(LOG_PREFIX, 0) == 0)
+            generations.push_back(stoull(name.substr(string(LOG_PREFIX).size())));
+    }
+    sort(generations.begin(), generations.end());
+    return generations;
+}
+
+// Loads the snapshot and replays logs up to max_generation. A torn tail is
+// tolerated only in the newest log, where a crash can interrupt a write.
+uint64_t LoadState(const fs::path& directory, uint64_t max_generation, deque<string>& documents,
+                   bool truncate_torn_tail) {
+    uint64_t snapshot_generation = 0;
+    const fs::path snapshot_path = directory / SNAPSHOT_NAME;
+    if (fs::exists(snapshot_path)) {
+        const string data = ReadFile(snapshot_path);
+        bool has_header = false;
+        const size_t valid = ReadRecords(data, [&](const Record& record) {
+            if (record.type == RECORD_SNAPSHOT && record.payload.size() == 8) {
+                snapshot_generation = GetUInt(record.payload.data(), 8);
+                has_header = true;
+            } else {
+                ApplyRecord(record, documents);
+            }
+        });
+        if (!has_header || valid != data.size())
+            throw runtime_error("corrupted journal snapshot");
+    }
+
+    vector<uint64_t> generations = ListLogGenerations(directory);
+    generations.erase(remove_if(generations.begin(), generations.end(), [&](uint64_t generation) {
+        return generation <= snapshot_generation || generation > max_generation;
+    }), generations.end());
+
+    for (size_t i = 0; i < generations.size(); ++i) {
+        const fs::path path = LogPath(directory, generations[i]);
+        const string data = ReadFile(path);
+        const size_t valid = ReadRecords(data, [&documents](const Record& record) {
+            ApplyRecord(record, documents);
+        });
+
+        if (valid != data.size()) {
+            if (i + 1 != generations.size())
+                throw runtime_error("corrupted journal log " + path.string());
+            if (truncate_torn_tail)
+                fs::resize_file(path, valid);
+        }
+    }
+
+    return generations.empty() ? snapshot_generation : generations.back();
+}
+
+DocumentJournal::DocumentJournal(string directory, uint64_t checkpoint_log_bytes)
+    : directory(move(directory))
+    , checkpoint_log_bytes(checkpoint_log_bytes) {
+    fs::create_directories(this->directory);
+    fs::remove(fs::path(this->directory) / SNAPSHOT_TMP_NAME);
+
+    // New records always go to a fresh log, so a recovered log is never appended to.
+    log_generation = LoadState(this->directory, UINT64_MAX, recovered, true) + 1;
+    log_fd = OpenLog(LogPath(this->directory, log_generation));
+    SyncDirectory(this->directory);
+
+    checkpointer = thread(&DocumentJournal::RunCheckpointer, this);
+}
+
+DocumentJournal::~DocumentJournal() {
+    {
+        lock_guard<mutex> guard(m);
+        stopping = true;
+    }
+    checkpoint_cv.notify_all();
+    checkpointer.join();
+
+    if (enqueued_ticket != durable_ticket) {
+        try {
+            WaitDurable(enqueued_ticket);
+        } catch (...) {
+        }
+    }
+    ::close(log_fd);
+}
+
+deque<string> DocumentJournal::TakeRecoveredDocuments() {
+    return move(recovered);
+}
+
+uint64_t DocumentJournal::LogReset(const deque<string>& documents) {
+    return Enqueue(RECORD_RESET, documents);
+}
+
+uint64_t DocumentJournal::LogAppend(const deque<string>& documents) {
+    return Enqueue(RECORD_APPEND, documents);
+}
+
+uint64_t DocumentJournal::Enqueue(uint8_t type, const deque<string>& documents) {
+    string record;
+    AppendRecord(record, type, documents.begin(), documents.end());
+
+    lock_guard<mutex> guard(m);
+    pending += record;
+    return ++enqueued_ticket;
+}
+
+void DocumentJournal::WaitDurable(uint64_t ticket) {
+    unique_lock<mutex> lock(m);
+
+    while (durable_ticket < ticket) {
+        if (failure)
+            rethrow_exception(failure);
+
+        if (flushing) {
+            flushed_cv.wait(lock);
+            continue;
+        }
+
+        flushing = true;
+        string batch;
+        batch.swap(pending);
+        const uint64_t batch_ticket = enqueued_ticket;
+        const int fd = log_fd;
+        lock.unlock();
+
+        exception_ptr error;
+        try {
+            WriteAll(fd, batch);
+            SyncFile(fd);
+        } catch (...) {
+            error = current_exception();
+        }
+
+        lock.lock();
+        flushing = false;
+        if (error)
+            failure = error;
+        else
+            durable_ticket = batch_ticket;
+        log_bytes += batch.size();
+        if (log_bytes >= checkpoint_log_bytes && !checkpoint_requested) {
+            checkpoint_requested = true;
+            checkpoint_cv.notify_one();
+        }
+        flushed_cv.notify_all();
+    }
+}
+
+void DocumentJournal::Checkpoint() {
+    lock_guard<mutex> checkpoint_guard(checkpoint_mutex);
+
+    uint64_t sealed_generation;
+    {
+        // Rotate once no flush is writing to the current log; records still
+        // pending go to the new log.
+        unique_lock<mutex> lock(m);
+        flushed_cv.wait(lock, [this] { return !flushing; });
+        if (failure)
+            rethrow_exception(failure);
+
+        const int new_fd = OpenLog(LogPath(directory, log_generation + 1));
+        ::close(log_fd);
+        log_fd = new_fd;
+        sealed_generation = log_generation++;
+        log_bytes = 0;
+    }
+    SyncDirectory(directory);
+
+    deque<string> documents;
+    LoadState(directory, sealed_generation, documents, false);
+
+    string snapshot;
+    string header(1, static_cast<char>(RECORD_SNAPSHOT));
+    PutU64(header, sealed_generation);
+    PutRecordPrefix(snapshot, header);
+    snapshot += header;
+    for (size_t first = 0; first < documents.size(); first += SNAPSHOT_CHUNK_DOCUMENTS) {
+        const size_t last = min(documents.size(), first + SNAPSHOT_CHUNK_DOCUMENTS);
+        AppendRecord(snapshot, RECORD_APPEND, documents.begin() + first, documents.begin() + last);
+    }
+
+    const fs::path tmp_path = fs::path(directory) / SNAPSHOT_TMP_NAME;
+    const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        ThrowSystemError("open " + tmp_path.string());
+    try {
+        WriteAll(fd, snapshot);
+        SyncFile(fd);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+
+    fs::rename(tmp_path, fs::path(directory) / SNAPSHOT_NAME);
+    SyncDirectory(directory);
+
+    for (uint64_t generation : ListLogGenerations(directory)) {
+        if (generation <= sealed_generation)
+            fs::remove(LogPath(directory, generation));
+    }
+}
+
+void DocumentJournal::RunCheckpointer() {
+    unique_lock<mutex> lock(m);
+
+    while (true) {
+        checkpoint_cv.wait(lock, [this] { return stopping || checkpoint_requested; });
+        if (stopping)
+            return;
+
+        lock.unlock();
+        try {
+            Checkpoint();
+        } catch (...) {
+            // The logs stay authoritative; the next request retries.
+        }
+        lock.lock();
+        checkpoint_requested = false;
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+// Crash-safe storage of the document base: a snapshot plus append-only logs of
+// checksummed update records. Each log file "log.<generation>" holds records
+// written after the snapshot of the previous generation; a checkpoint rotates
+// to a new log and folds the old ones into a fresh snapshot in the background.
+//
+// Appends are group-committed: records are buffered in order, and whichever
+// caller reaches WaitDurable first writes and fsyncs everything buffered so
+// far on behalf of all waiting callers.
+class DocumentJournal {
+public:
+    explicit DocumentJournal(string directory, uint64_t checkpoint_log_bytes = 64 << 20);
+
+    ~DocumentJournal();
+
+    // Document base recovered from the snapshot and the log tail at startup.
+    deque<string> TakeRecoveredDocuments();
+
+    // Buffer an update record and return the ticket to wait on.
+    uint64_t LogReset(const deque<string>& documents);
+    uint64_t LogAppend(const deque<string>& documents);
+
+    // Returns once the record with this ticket and all earlier ones are on disk.
+    void WaitDurable(uint64_t ticket);
+
+    // Folds every log written so far into the snapshot.
+    void Checkpoint();
+
+private:
+    string directory;
+    uint64_t checkpoint_log_bytes;
+    deque<string> recovered;
+
+    mutex m;
+    condition_variable flushed_cv;
+    condition_variable checkpoint_cv;
+    string pending;
+    uint64_t enqueued_ticket = 0;
+    uint64_t durable_ticket = 0;
+    bool flushing = false;
+    exception_ptr failure;
+
+    int log_fd = -1;
+    uint64_t log_generation = 0;
+    uint64_t log_bytes = 0;
+
+    mutex checkpoint_mutex;
+    bool checkpoint_requested = false;
+    bool stopping = false;
+    thread checkpointer;
+
+    uint64_t Enqueue(uint8_t type, const deque<string>& documents);
+    void RunCheckpointer();
+};
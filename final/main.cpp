@@ -2,6 +2,7 @@
 #include "parse.h"
 #include "test_runner.h"
 #include "profile.h"
+#include "simd.h"
 
 #include <algorithm>
 #include <iterator>
@@ -12,6 +13,9 @@
 #include <fstream>
 #include <random>
 #include <thread>
+#include <atomic>
+#include <deque>
+#include <filesystem>
 
 using namespace std;
 
@@ -20,22 +24,24 @@ void TestFunctionality(
   const vector<string>& queries,
   const vector<string>& expected
 ) {
-    istringstream docs_input(Join('\n', docs));
-    istringstream queries_input(Join('\n', queries));
+    for (size_t shard_count : {1, 3}) {
+        istringstream docs_input(Join('\n', docs));
+        istringstream queries_input(Join('\n', queries));
 
-    ostringstream queries_output;
+        ostringstream queries_output;
 
-    {
-        SearchServer srv(docs_input);
-//        srv.UpdateDocumentBase(docs_input);
-        srv.AddQueriesStream(queries_input, queries_output);
-    }
+        {
+            SearchServer srv(docs_input, shard_count);
+//            srv.UpdateDocumentBase(docs_input);
+            srv.AddQueriesStream(queries_input, queries_output);
+        }
 
-    const string result = queries_output.str();
-    const auto lines = SplitBy(Strip(result), '\n');
-    ASSERT_EQUAL(lines.size(), expected.size());
-    for (size_t i = 0; i < lines.size(); ++i) {
-        ASSERT_EQUAL(lines[i], expected[i]);
+        const string result = queries_output.str();
+        const auto lines = SplitBy(Strip(result), '\n');
+        ASSERT_EQUAL(lines.size(), expected.size());
+        for (size_t i = 0; i < lines.size(); ++i) {
+            ASSERT_EQUAL(lines[i], expected[i]);
+        }
     }
 }
 
@@ -205,6 +211,715 @@ void TestBasicSearch() {
     TestFunctionality(docs, queries, expected);
 }
 
+void TestMemoryStats() {
+    istringstream docs_input(Join('\n', vector{
+            "the river goes through the entire city there is a house near it",
+            "the wall",
+            "walle",
+            "is is is is",
+    }));
+    InvertedIndex index(docs_input);
+
+    auto stats = index.GetMemoryStats();
+    ASSERT(stats.postings_used_bytes > 0);
+    ASSERT(stats.postings_reserved_bytes >= stats.postings_used_bytes);
+    ASSERT(stats.dictionary_bytes > 0);
+    ASSERT(stats.node_overhead_bytes > 0);
+    ASSERT(stats.documents_bytes >= 4 * sizeof(string));
+
+    index.ShrinkToFit();
+
+    const auto shrunk = index.GetMemoryStats();
+    ASSERT_EQUAL(shrunk.postings_reserved_bytes, shrunk.postings_used_bytes);
+    ASSERT_EQUAL(shrunk.postings_used_bytes, stats.postings_used_bytes);
+    ASSERT_EQUAL(shrunk.dictionary_bytes, stats.dictionary_bytes);
+    ASSERT(shrunk.Total() <= stats.Total());
+    ASSERT_EQUAL(index.Lookup("the").size(), 2u);
+}
+
+vector<size_t> CollectPostings(const InvertedIndex::Postings& postings) {
+    vector<size_t> result;
+    postings.ForEach([&result](size_t docid, size_t hit_count) {
+        result.push_back(docid);
+        result.push_back(hit_count);
+    });
+    return result;
+}
+
+void TestFrozenIndex() {
+    const string docs = Join('\n', vector{
+            "london is the capital of great britain",
+            "i am travelling down the river",
+            "the river goes through the entire city there is a house near it",
+            "is is is is",
+            "b",
+    });
+    istringstream docs_input(docs);
+    istringstream frozen_docs_input(docs);
+    InvertedIndex index(docs_input);
+    InvertedIndex frozen_index(frozen_docs_input);
+
+    const auto stats = frozen_index.GetMemoryStats();
+    frozen_index.Freeze();
+    ASSERT(frozen_index.IsFrozen());
+
+    const auto frozen_stats = frozen_index.GetMemoryStats();
+    ASSERT_EQUAL(frozen_stats.node_overhead_bytes, 0u);
+    ASSERT_EQUAL(frozen_stats.postings_used_bytes, stats.postings_used_bytes);
+    ASSERT(frozen_stats.Total() < stats.Total());
+
+    vector<string_view> words = SplitIntoWords(docs);
+    words.insert(words.end(), {"", "a", "aa", "zzz", "river2", "rive", "londo", "c"});
+    for (string_view word : words) {
+        ASSERT_EQUAL(frozen_index.Lookup(word).size(), index.Lookup(word).size());
+        ASSERT_EQUAL(CollectPostings(frozen_index.Lookup(word)), CollectPostings(index.Lookup(word)));
+    }
+}
+
+void TestBitmapPostings() {
+    vector<size_t> docids;
+    for (size_t docid = 0; docid <= 5000; ++docid)
+        docids.push_back(docid);
+    docids.insert(docids.end(), {70000, 70005, 131071});
+    for (size_t i = 0; i < 5000; ++i)
+        docids.push_back(200000 + i * 3);
+
+    BitmapPostings bitmap;
+    vector<size_t> expected;
+    for (size_t docid : docids) {
+        bitmap.PushBack(docid, docid % 7 + 1);
+        expected.push_back(docid);
+        expected.push_back(docid % 7 + 1);
+    }
+    ASSERT_EQUAL(bitmap.size(), docids.size());
+
+    vector<size_t> actual;
+    bitmap.ForEach([&actual](size_t docid, size_t hit_count) {
+        actual.push_back(docid);
+        actual.push_back(hit_count);
+    });
+    ASSERT_EQUAL(actual, expected);
+
+    // Docids 0..4991 fill whole bitmap words and arrive as one run.
+    vector<size_t> expected_counts(docids.back() + 1);
+    for (size_t docid : docids)
+        expected_counts[docid] = docid % 7 + 1;
+
+    vector<size_t> counts(expected_counts.size());
+    size_t run_docids = 0;
+    bitmap.ForEachWithRuns([&counts](size_t docid, size_t hit_count) {
+        counts[docid] += hit_count;
+    }, [&](size_t first_docid, const uint32_t* hit_counts, size_t count) {
+        AddHitCounts(counts.data() + first_docid, hit_counts, count);
+        run_docids += count;
+    }, [] { return false; });
+    ASSERT_EQUAL(counts, expected_counts);
+    ASSERT_EQUAL(run_docids, 4992u);
+
+    // Assign sizes the buffers up front and matches the incremental build.
+    vector<InvertedIndex::DocHits> doc_hits;
+    for (size_t docid : docids)
+        doc_hits.push_back({docid, docid % 7 + 1});
+    BitmapPostings assigned;
+    assigned.Assign(doc_hits.begin(), doc_hits.end());
+    ASSERT_EQUAL(assigned.GetReservedBytes(), assigned.GetUsedBytes());
+    bitmap.ShrinkToFit();
+    ASSERT_EQUAL(assigned.GetUsedBytes(), bitmap.GetUsedBytes());
+    actual.clear();
+    assigned.ForEach([&actual](size_t docid, size_t hit_count) {
+        actual.push_back(docid);
+        actual.push_back(hit_count);
+    });
+    ASSERT_EQUAL(actual, expected);
+
+    ostringstream docs;
+    for (size_t docid = 0; docid < 70000; ++docid)
+        docs << "the a" << docid % 3 << (docid % 5 == 0 ? " the" : "") << (docid % 1000 == 0 ? " rare" : "") << '\n';
+    istringstream docs_input(docs.str());
+    istringstream frozen_docs_input(docs.str());
+    InvertedIndex index(docs_input);
+    InvertedIndex frozen_index(frozen_docs_input);
+    frozen_index.Freeze();
+
+    for (string_view word : {"the", "a0", "a1", "rare", "missing"})
+        ASSERT_EQUAL(CollectPostings(frozen_index.Lookup(word)), CollectPostings(index.Lookup(word)));
+    ASSERT(frozen_index.GetMemoryStats().postings_used_bytes * 2 < index.GetMemoryStats().postings_used_bytes);
+}
+
+void TestPrefixSearch() {
+    const vector<string> docs = {
+            "it is going to be legen wait for it dary legendary",
+            "legend of the legends",
+            "leg",
+            "the legacy",
+    };
+    const vector<string> queries = {"legen*", "lege* leg", "x*", "*"};
+    const vector<string> expected = {
+            Join(' ', vector{
+                    "legen*:",
+                    "{docid: 0, hitcount: 2}",
+                    "{docid: 1, hitcount: 2}",
+            }),
+            Join(' ', vector{
+                    "lege* leg:",
+                    "{docid: 0, hitcount: 2}",
+                    "{docid: 1, hitcount: 2}",
+                    "{docid: 2, hitcount: 1}",
+            }),
+            "x*:",
+            "*:",
+    };
+    TestFunctionality(docs, queries, expected);
+
+    for (bool frozen : {false, true}) {
+        istringstream docs_input(Join('\n', docs));
+        InvertedIndex index(docs_input);
+        if (frozen)
+            index.Freeze();
+
+        ASSERT_EQUAL(index.LookupPrefix("leg", 10).size(), 6u);
+        ASSERT_EQUAL(index.LookupPrefix("leg", 2).size(), 2u);
+        ASSERT_EQUAL(index.LookupPrefix("leg", 2)[0].size(), 1u);
+        ASSERT_EQUAL(index.LookupPrefix("legends", 10).size(), 1u);
+        ASSERT_EQUAL(index.LookupPrefix("legendz", 10).size(), 0u);
+        ASSERT_EQUAL(index.LookupPrefix("zz", 10).size(), 0u);
+    }
+
+    // "p*" matches 100 terms; the 64 expanded ones must be the same however
+    // the dictionary is split between shards.
+    vector<string> capped_docs;
+    for (size_t i = 0; i < 100; ++i)
+        capped_docs.push_back("p0" + string(i < 10 ? "0" : "") + to_string(i));
+    capped_docs.back() += " p099";
+
+    istringstream capped_docs_input(Join('\n', capped_docs));
+    istringstream capped_queries_input("p*");
+    ostringstream capped_output;
+    {
+        SearchServer srv(capped_docs_input);
+        srv.AddQueriesStream(capped_queries_input, capped_output);
+    }
+    ASSERT_EQUAL(capped_output.str(), Join(' ', vector{
+            "p*:",
+            "{docid: 0, hitcount: 1}",
+            "{docid: 1, hitcount: 1}",
+            "{docid: 2, hitcount: 1}",
+            "{docid: 3, hitcount: 1}",
+            "{docid: 4, hitcount: 1}\n",
+    }));
+
+    for (size_t shard_count : {2, 3, 7}) {
+        istringstream docs_input(Join('\n', capped_docs));
+        istringstream queries_input("p*");
+        ostringstream queries_output;
+        {
+            SearchServer srv(docs_input, shard_count);
+            srv.AddQueriesStream(queries_input, queries_output);
+        }
+        ASSERT_EQUAL(queries_output.str(), capped_output.str());
+    }
+}
+
+void TestRepeatedQueries() {
+    const vector<string> docs = {
+            "how hard could it be",
+            "it is going to be legen wait for it dary legendary",
+            "just keep track of it",
+    };
+
+    vector<string> queries;
+    vector<string> expected;
+    for (int i = 0; i < 300; ++i) {
+        queries.push_back("it it");
+        expected.push_back("it it: {docid: 1, hitcount: 4} {docid: 0, hitcount: 2} {docid: 2, hitcount: 2}");
+        queries.push_back("be");
+        expected.push_back("be: {docid: 0, hitcount: 1} {docid: 1, hitcount: 1}");
+        queries.push_back("dislike");
+        expected.push_back("dislike:");
+    }
+    TestFunctionality(docs, queries, expected);
+}
+
+void TestShardedUpdate() {
+    istringstream docs_input("a b\nb c\nc d\nd e\ne a");
+    istringstream updated_docs_input("x y\ny\nx\ny y y\nz");
+    istringstream queries_input("y x");
+    ostringstream queries_output;
+
+    {
+        SearchServer srv(docs_input, 4);
+        ASSERT_EQUAL(srv.GetShardCount(), 4u);
+        srv.UpdateDocumentBase(updated_docs_input);
+        srv.Wait();
+        srv.AddQueriesStream(queries_input, queries_output);
+    }
+
+    ASSERT_EQUAL(queries_output.str(), Join(' ', vector{
+            "y x:",
+            "{docid: 3, hitcount: 3}",
+            "{docid: 0, hitcount: 2}",
+            "{docid: 1, hitcount: 1}",
+            "{docid: 2, hitcount: 1}\n",
+    }));
+}
+
+// Updates publish all shards at once: while the base flips between documents
+// that all contain "a" and documents that all contain "b", every search sees
+// one base in every shard, never "a" hits from some shards and "b" from others.
+void TestUpdateIsAtomicAcrossShards() {
+    const string a_docs = "a\na\na\na\na\na";
+    const string b_docs = "b\nb\nb\nb\nb\nb";
+    istringstream docs_input(a_docs);
+    SearchServer srv(docs_input, 3);
+
+    deque<istringstream> updates;
+    for (size_t i = 0; i < 200; ++i)
+        updates.emplace_back(i % 2 ? a_docs : b_docs);
+
+    atomic<bool> done = false;
+    thread updater([&] {
+        for (auto& update : updates) {
+            srv.UpdateDocumentBase(update);
+            this_thread::yield();
+        }
+        srv.Wait();
+        done = true;
+    });
+
+    vector<SearchResult> results;
+    size_t searches = 0;
+    size_t mixed = 0;
+    while (!done || searches == 0) {
+        srv.Search(vector<string_view>{"a", "b"}, results);
+        if (results[0].documents.empty() == results[1].documents.empty()
+            || results[0].documents.size() + results[1].documents.size() != 5)
+            ++mixed;
+        ++searches;
+    }
+    updater.join();
+    ASSERT_EQUAL(mixed, 0u);
+}
+
+string RunQueries(const string& docs, const string& queries, QueryOptions options, size_t shard_count = 1) {
+    istringstream docs_input(docs);
+    istringstream queries_input(queries);
+    ostringstream queries_output;
+
+    {
+        SearchServer srv(docs_input, shard_count);
+        srv.AddQueriesStream(queries_input, queries_output, options);
+    }
+
+    return queries_output.str();
+}
+
+void TestQueryBudget() {
+    const string docs = "london is the capital of great britain\ni am travelling down the river";
+    const string queries = "london\nthe\nrock";
+
+    for (size_t shard_count : {1, 2}) {
+        QueryOptions generous;
+        generous.query_budget = chrono::hours(1);
+        ASSERT_EQUAL(RunQueries(docs, queries, generous, shard_count), Join('\n', vector{
+                "london: {docid: 0, hitcount: 1}",
+                "the: {docid: 0, hitcount: 1} {docid: 1, hitcount: 1}",
+                "rock:\n",
+        }));
+
+        QueryOptions exhausted;
+        exhausted.query_budget = chrono::steady_clock::duration::zero();
+        const string output = RunQueries(docs, queries, exhausted, shard_count);
+        const auto lines = SplitBy(Strip(output), '\n');
+        ASSERT_EQUAL(lines.size(), 3u);
+        ASSERT_EQUAL(lines[0], "london: [truncated]");
+        ASSERT_EQUAL(lines[1], "the: [truncated]");
+        ASSERT_EQUAL(lines[2], "rock:");
+    }
+
+    // One query walking 100000 postings shares a batch with cheap ones whose
+    // terms come later in the scan; only the expensive one runs out of budget.
+    ostringstream large_docs;
+    for (size_t docid = 0; docid < 100'000; ++docid)
+        large_docs << 't' << docid % 20 << (docid % 30'000 == 1 ? " zc" + to_string(docid / 30'000) : "") << '\n';
+    istringstream large_docs_input(large_docs.str());
+    SearchServer srv(large_docs_input);
+
+    string expensive;
+    for (size_t term = 0; term < 20; ++term)
+        expensive += " t" + to_string(term);
+    vector<SearchResult> results;
+    QueryOptions tight;
+    tight.query_budget = chrono::microseconds(20);
+    ASSERT(srv.Search(vector<string_view>{expensive, "zc0", "zc1", "zc2"}, results, tight));
+    ASSERT(results[0].truncated);
+    for (size_t i = 1; i < 4; ++i) {
+        ASSERT(!results[i].truncated);
+        ASSERT(!results[i].documents.empty());
+    }
+}
+
+void TestCancellation() {
+    const string docs = "a b\nb c";
+    const string queries = "a\nb\nc";
+
+    CancellationToken token;
+    QueryOptions options;
+    options.cancellation = &token;
+    ASSERT_EQUAL(RunQueries(docs, queries, options), "a: {docid: 0, hitcount: 1}\n"
+                                                     "b: {docid: 0, hitcount: 1} {docid: 1, hitcount: 1}\n"
+                                                     "c: {docid: 1, hitcount: 1}\n");
+
+    token.Cancel();
+    ASSERT_EQUAL(RunQueries(docs, queries, options), "");
+}
+
+void TestFairScheduling() {
+    string trace;
+    StreamStats large_stats, small_stats;
+    promise<void> small_added;
+    {
+        QueryScheduler scheduler(1);
+
+        int large_blocks = 0;
+        auto large = scheduler.AddStream([&] {
+            if (large_blocks == 0)
+                small_added.get_future().wait();
+            if (large_blocks == 10)
+                return false;
+            ++large_blocks;
+            trace += 'L';
+            return true;
+        }, 1, &large_stats);
+
+        int small_blocks = 0;
+        auto small = scheduler.AddStream([&] {
+            if (small_blocks == 2)
+                return false;
+            ++small_blocks;
+            trace += 's';
+            return true;
+        }, 1, &small_stats);
+        small_added.set_value();
+
+        small.get();
+        large.get();
+    }
+
+    ASSERT_EQUAL(trace, "LsLsLLLLLLLL");
+    ASSERT_EQUAL(large_stats.blocks, 10u);
+    ASSERT_EQUAL(small_stats.blocks, 2u);
+    ASSERT(small_stats.max_queue_latency <= small_stats.total_queue_latency);
+}
+
+void TestSchedulerErrors() {
+    QueryScheduler scheduler(2);
+    auto failing = scheduler.AddStream([]() -> bool {
+        throw runtime_error("broken stream");
+    });
+
+    bool thrown = false;
+    try {
+        failing.get();
+    } catch (runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+string RunQueries(SearchServer& srv, const string& queries) {
+    istringstream queries_input(queries);
+    ostringstream queries_output;
+    srv.AddQueriesStream(queries_input, queries_output);
+    srv.Wait();
+    return queries_output.str();
+}
+
+void TestAddDocumentsOrder() {
+    SearchServer srv;
+    vector<istringstream> inputs;
+    for (int i = 0; i < 6; ++i)
+        inputs.emplace_back(string(i + 1, 'x'));
+    for (auto& input : inputs)
+        srv.AddDocuments(input);
+    srv.Wait();
+
+    ASSERT_EQUAL(RunQueries(srv, "xxx xxxxx"), "xxx xxxxx: {docid: 2, hitcount: 1} {docid: 4, hitcount: 1}\n");
+}
+
+void TestFailedUpdate() {
+    struct FailingBuffer : streambuf {
+        int_type underflow() override {
+            throw runtime_error("read failed");
+        }
+    };
+
+    FailingBuffer failing_buffer;
+    istream failing_input(&failing_buffer);
+    failing_input.exceptions(ios::badbit);
+    istringstream docs_input("a\nb");
+    istringstream added_input("a a");
+
+    SearchServer srv(docs_input);
+    srv.UpdateDocumentBase(failing_input);
+    srv.AddDocuments(added_input);
+    try {
+        srv.Wait();
+        ASSERT(false);
+    } catch (runtime_error& e) {
+        ASSERT_EQUAL(string(e.what()), "read failed");
+    }
+
+    // The failed update left the base as it was and did not hold up the next one.
+    ASSERT_EQUAL(RunQueries(srv, "a"), "a: {docid: 2, hitcount: 2} {docid: 0, hitcount: 1}\n");
+}
+
+void TestJournalRecovery() {
+    const auto directory = filesystem::temp_directory_path() / ("search_server_journal_" + to_string(random_device()()));
+    filesystem::remove_all(directory);
+
+    {
+        SearchServer srv(directory.string(), 2);
+        istringstream docs_input("a b\nb c");
+        istringstream added_docs_input("c d\nc");
+        srv.UpdateDocumentBase(docs_input);
+        srv.Wait();
+        srv.AddDocuments(added_docs_input);
+        srv.Wait();
+        ASSERT_EQUAL(RunQueries(srv, "c"), "c: {docid: 1, hitcount: 1} {docid: 2, hitcount: 1} {docid: 3, hitcount: 1}\n");
+    }
+
+    {
+        SearchServer srv(directory.string(), 3);
+        ASSERT_EQUAL(RunQueries(srv, "c"), "c: {docid: 1, hitcount: 1} {docid: 2, hitcount: 1} {docid: 3, hitcount: 1}\n");
+
+        srv.Checkpoint();
+        ASSERT(filesystem::exists(directory / "snapshot"));
+
+        vector<istringstream> inputs;
+        for (int i = 0; i < 4; ++i)
+            inputs.emplace_back("b");
+        for (auto& input : inputs)
+            srv.AddDocuments(input);
+        srv.Wait();
+    }
+
+    // A crash in the middle of a write leaves a torn record at the end of the newest log.
+    filesystem::path newest_log;
+    for (const auto& entry : filesystem::directory_iterator(directory)) {
+        if (entry.path().filename().string().rfind("log.", 0) == 0 && entry.path() > newest_log)
+            newest_log = entry.path();
+    }
+    ofstream(newest_log, ios::binary | ios::app) << string("\x10\x00\x00\x00garbage", 11);
+
+    {
+        SearchServer srv(directory.string());
+        ASSERT_EQUAL(RunQueries(srv, "b"), Join(' ', vector{
+                "b:",
+                "{docid: 0, hitcount: 1}",
+                "{docid: 1, hitcount: 1}",
+                "{docid: 4, hitcount: 1}",
+                "{docid: 5, hitcount: 1}",
+                "{docid: 6, hitcount: 1}\n",
+        }));
+
+        istringstream docs_input("z");
+        srv.UpdateDocumentBase(docs_input);
+        srv.Wait();
+    }
+
+    {
+        SearchServer srv(directory.string());
+        ASSERT_EQUAL(RunQueries(srv, "z b"), "z b: {docid: 0, hitcount: 1}\n");
+    }
+
+    filesystem::remove_all(directory);
+}
+
+void TestSynchronizedReadAccess() {
+    Synchronized<int> value(1);
+
+    {
+        auto first = value.GetReadAccess();
+        auto second = async(launch::async, [&value] {
+            return value.GetReadAccess().ref_to_value;
+        });
+        ASSERT(second.wait_for(chrono::seconds(5)) == future_status::ready);
+        ASSERT_EQUAL(second.get(), 1);
+    }
+
+    // A reader arriving while a writer waits must let the writer go first.
+    string order;
+    mutex order_mutex;
+    future<void> writer, late_reader;
+    {
+        auto reader = value.GetReadAccess();
+        writer = async(launch::async, [&] {
+            auto access = value.GetAccess();
+            lock_guard<mutex> guard(order_mutex);
+            order += 'W';
+            access.ref_to_value = 2;
+        });
+        this_thread::sleep_for(chrono::milliseconds(100));
+
+        late_reader = async(launch::async, [&] {
+            auto access = value.GetReadAccess();
+            lock_guard<mutex> guard(order_mutex);
+            order += 'R';
+        });
+        this_thread::sleep_for(chrono::milliseconds(100));
+        ASSERT_EQUAL(order, "");
+    }
+    writer.get();
+    late_reader.get();
+
+    ASSERT_EQUAL(order, "WR");
+    ASSERT_EQUAL(value.GetReadAccess().ref_to_value, 2);
+}
+
+void TestDirectSearch() {
+    for (size_t shard_count : {1, 3}) {
+        istringstream docs_input("a b c\nb b\nc\nb c c");
+        SearchServer srv(docs_input, shard_count);
+
+        vector<SearchResult> results;
+        ASSERT(srv.Search(vector<string_view>{"b", "x", "c*", "b"}, results));
+        ASSERT_EQUAL(results.size(), 4u);
+
+        vector<size_t> documents;
+        for (const auto& [docid, hit_count] : results[0].documents) {
+            documents.push_back(docid);
+            documents.push_back(hit_count);
+        }
+        ASSERT_EQUAL(documents, (vector<size_t>{1, 2, 0, 1, 3, 1}));
+        ASSERT(results[1].documents.empty());
+        ASSERT_EQUAL(results[2].documents.size(), 3u);
+        ASSERT_EQUAL(results[2].documents[0].docid, 3u);
+        ASSERT_EQUAL(results[2].documents[0].hit_count, 2u);
+        ASSERT_EQUAL(results[3].documents.size(), results[0].documents.size());
+
+        // Results are written in place, so a reused buffer keeps its allocations.
+        const auto* documents_data = results[0].documents.data();
+        ASSERT(srv.Search(vector<string_view>{"b", "x", "c*", "b"}, results));
+        ASSERT_EQUAL(results[0].documents.data(), documents_data);
+
+        // The buffer form agrees with the line-oriented stream API.
+        const string queries = "c\n\nb c\n";
+        ASSERT(srv.Search(string_view(queries), results));
+        ASSERT_EQUAL(results.size(), 3u);
+        ASSERT(results[1].documents.empty());
+        ASSERT_EQUAL(results[2].documents[0].docid, 3u);
+        ASSERT_EQUAL(results[2].documents[0].hit_count, 3u);
+        ASSERT_EQUAL(RunQueries(srv, queries),
+                     "c: {docid: 3, hitcount: 2} {docid: 0, hitcount: 1} {docid: 2, hitcount: 1}\n"
+                     ":\n"
+                     "b c: {docid: 3, hitcount: 3} {docid: 0, hitcount: 2} {docid: 1, hitcount: 2} "
+                     "{docid: 2, hitcount: 1}\n");
+
+        CancellationToken token;
+        token.Cancel();
+        QueryOptions options;
+        options.cancellation = &token;
+        ASSERT(!srv.Search(string_view(queries), results, options));
+    }
+}
+
+// More than 4096 documents per shard, with terms in every or nearly every
+// document, so searches go through bitmap containers and runs of full words.
+void TestDenseTerms() {
+    vector<string> docs;
+    for (size_t docid = 0; docid < 40000; ++docid) {
+        string doc = "all";
+        for (size_t i = 0; i < docid % 3; ++i)
+            doc += " all";
+        if (docid % 13 != 0)
+            doc += docid % 1009 == 0 ? " most most" : " most";
+        doc += " w" + to_string(docid % 50);
+        docs.push_back(doc);
+    }
+
+    const vector<string_view> queries = {"all", "most", "all most", "most w7", "all* w49"};
+    // Flattened docid, hit count pairs of the top five, best first.
+    vector<vector<size_t>> expected;
+    for (string_view query : queries) {
+        vector<string_view> terms = SplitIntoWords(query);
+        for (string_view& term : terms) {
+            if (term.back() == '*')
+                term.remove_suffix(1);
+        }
+
+        vector<pair<size_t, size_t>> ranking;
+        for (size_t docid = 0; docid < docs.size(); ++docid) {
+            size_t hit_count = 0;
+            for (string_view word : SplitIntoWords(docs[docid]))
+                hit_count += count(terms.begin(), terms.end(), word);
+            if (hit_count > 0)
+                ranking.push_back({docid, hit_count});
+        }
+        stable_sort(ranking.begin(), ranking.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.second > rhs.second;
+        });
+        ranking.resize(min<size_t>(ranking.size(), 5));
+        expected.emplace_back();
+        for (const auto& [docid, hit_count] : ranking) {
+            expected.back().push_back(docid);
+            expected.back().push_back(hit_count);
+        }
+    }
+
+    ostringstream docs_output;
+    for (const string& doc : docs)
+        docs_output << doc << '\n';
+    for (size_t shard_count : {1, 3, 8}) {
+        istringstream docs_input(docs_output.str());
+        SearchServer srv(docs_input, shard_count);
+
+        vector<SearchResult> results;
+        ASSERT(srv.Search(queries, results));
+        ASSERT_EQUAL(results.size(), queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            vector<size_t> actual;
+            for (const auto& [docid, hit_count] : results[i].documents) {
+                actual.push_back(docid);
+                actual.push_back(hit_count);
+            }
+            ASSERT_EQUAL(actual, expected[i]);
+        }
+    }
+}
+
+void TestBuildFrozen() {
+    ostringstream docs;
+    for (size_t docid = 0; docid < 30000; ++docid) {
+        docs << "the a" << docid % 7 << " b" << docid % 1000 << (docid % 5 == 0 ? " the" : "")
+             << (docid % 3000 == 0 ? " rare rare" : "") << '\n';
+    }
+    istringstream docs_input(docs.str());
+    InvertedIndex index(docs_input);
+    index.Freeze();
+
+    for (size_t worker_count : {1, 4}) {
+        istringstream built_docs_input(docs.str());
+        deque<string> documents;
+        for (string document; getline(built_docs_input, document);)
+            documents.push_back(move(document));
+        const InvertedIndex built = InvertedIndex::BuildFrozen(move(documents), worker_count);
+        ASSERT(built.IsFrozen());
+        ASSERT_EQUAL(built.GetDocumentCount(), index.GetDocumentCount());
+
+        for (string_view word : {"the", "a0", "a6", "b0", "b999", "rare", "missing", ""})
+            ASSERT_EQUAL(CollectPostings(built.Lookup(word)), CollectPostings(index.Lookup(word)));
+        ASSERT_EQUAL(built.LookupPrefix("b1", 1000).size(), index.LookupPrefix("b1", 1000).size());
+
+        // Slots are sized from the first pass, so nothing is reserved beyond use.
+        const auto stats = built.GetMemoryStats();
+        ASSERT_EQUAL(stats.postings_used_bytes, index.GetMemoryStats().postings_used_bytes);
+        ASSERT_EQUAL(stats.postings_reserved_bytes, stats.postings_used_bytes);
+    }
+
+    const InvertedIndex empty = InvertedIndex::BuildFrozen({}, 4);
+    ASSERT_EQUAL(empty.Lookup("the").size(), 0u);
+}
+
 void TestSpeed() {
     vector<string> docs(800);
 
@@ -240,12 +955,12 @@ void TestSpeed() {
     istringstream docs_input2(Join('\n', docs));
     istringstream queries_input1(Join('\n', queries));
     istringstream queries_input2(Join('\n', queries));
+    ostringstream queries_output1, queries_output2;
 
     LOG_DURATION("speed")
 
     SearchServer srv(docs_input1);
     srv.UpdateDocumentBase(docs_input2);
-    ostringstream queries_output1, queries_output2;
 
     srv.AddQueriesStream(queries_input1, queries_output1);
     srv.AddQueriesStream(queries_input2, queries_output2);
@@ -258,5 +973,23 @@ int main() {
     RUN_TEST(tr, TestHitcount);
     RUN_TEST(tr, TestRanking);
     RUN_TEST(tr, TestBasicSearch);
+    RUN_TEST(tr, TestMemoryStats);
+    RUN_TEST(tr, TestFrozenIndex);
+    RUN_TEST(tr, TestBitmapPostings);
+    RUN_TEST(tr, TestBuildFrozen);
+    RUN_TEST(tr, TestPrefixSearch);
+    RUN_TEST(tr, TestRepeatedQueries);
+    RUN_TEST(tr, TestShardedUpdate);
+    RUN_TEST(tr, TestUpdateIsAtomicAcrossShards);
+    RUN_TEST(tr, TestQueryBudget);
+    RUN_TEST(tr, TestCancellation);
+    RUN_TEST(tr, TestFairScheduling);
+    RUN_TEST(tr, TestSchedulerErrors);
+    RUN_TEST(tr, TestSynchronizedReadAccess);
+    RUN_TEST(tr, TestAddDocumentsOrder);
+    RUN_TEST(tr, TestFailedUpdate);
+    RUN_TEST(tr, TestJournalRecovery);
+    RUN_TEST(tr, TestDirectSearch);
+    RUN_TEST(tr, TestDenseTerms);
     TestSpeed();
 }
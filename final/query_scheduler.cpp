@@ -0,0 +1,89 @@
+#include "query_scheduler.h"
+
+#include <algorithm>
+
+QueryScheduler::QueryScheduler(size_t worker_count) {
+    if (worker_count == 0)
+        worker_count = max(1u, thread::hardware_concurrency());
+
+    for (size_t i = 0; i < worker_count; ++i)
+        workers.emplace_back(&QueryScheduler::Work, this);
+}
+
+QueryScheduler::~QueryScheduler() {
+    {
+        lock_guard<mutex> guard(m);
+        stopping = true;
+    }
+    ready_cv.notify_all();
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+future<void> QueryScheduler::AddStream(BlockProcessor process_block, size_t weight, StreamStats* stats) {
+    auto stream = make_shared<Stream>();
+    stream->process_block = move(process_block);
+    stream->weight = max<size_t>(weight, 1);
+    stream->stats_output = stats;
+    stream->ready_since = chrono::steady_clock::now();
+
+    future<void> result = stream->done.get_future();
+    {
+        lock_guard<mutex> guard(m);
+        ready.push_back(move(stream));
+    }
+    ready_cv.notify_one();
+
+    return result;
+}
+
+// Workers leave only once stopping is set and nothing is queued; a stream that
+// is being processed is re-queued by the worker holding it, which then keeps
+// serving it, so the destructor drains every stream before joining.
+void QueryScheduler::Work() {
+    unique_lock<mutex> lock(m);
+
+    while (true) {
+        ready_cv.wait(lock, [this] { return stopping || !ready.empty(); });
+        if (ready.empty())
+            return;
+
+        shared_ptr<Stream> stream = move(ready.front());
+        ready.pop_front();
+        lock.unlock();
+
+        const auto latency = chrono::steady_clock::now() - stream->ready_since;
+        stream->stats.total_queue_latency += latency;
+        stream->stats.max_queue_latency = max(stream->stats.max_queue_latency, latency);
+
+        bool has_more = true;
+        exception_ptr error;
+        try {
+            for (size_t i = 0; i < stream->weight && has_more; ++i) {
+                has_more = stream->process_block();
+                if (has_more)
+                    ++stream->stats.blocks;
+            }
+        } catch (...) {
+            error = current_exception();
+            has_more = false;
+        }
+
+        if (!has_more) {
+            if (stream->stats_output)
+                *stream->stats_output = stream->stats;
+
+            if (error)
+                stream->done.set_exception(error);
+            else
+                stream->done.set_value();
+        }
+
+        lock.lock();
+        if (has_more) {
+            stream->ready_since = chrono::steady_clock::now();
+            ready.push_back(move(stream));
+        }
+    }
+}
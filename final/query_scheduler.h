@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct StreamStats {
+    size_t blocks = 0;
+    chrono::steady_clock::duration total_queue_latency{};
+    chrono::steady_clock::duration max_queue_latency{};
+};
+
+// Runs many block-structured streams on a fixed worker pool. Ready streams are
+// served round-robin, each turn running up to `weight` blocks, and a stream is
+// never processed by two workers at once, so its blocks stay in order.
+class QueryScheduler {
+public:
+    // Processes the next block of a stream; returns false when the stream is finished.
+    using BlockProcessor = function<bool()>;
+
+    explicit QueryScheduler(size_t worker_count = 0);
+
+    ~QueryScheduler();
+
+    future<void> AddStream(BlockProcessor process_block, size_t weight = 1, StreamStats* stats = nullptr);
+
+private:
+    struct Stream {
+        BlockProcessor process_block;
+        size_t weight;
+        StreamStats* stats_output;
+        StreamStats stats;
+        promise<void> done;
+        chrono::steady_clock::time_point ready_since;
+    };
+
+    mutex m;
+    condition_variable ready_cv;
+    deque<shared_ptr<Stream>> ready;
+    bool stopping = false;
+    vector<thread> workers;
+
+    void Work();
+};
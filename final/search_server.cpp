@@ -1,20 +1,35 @@
 #include "search_server.h"
 #include "iterator_range.h"
 #include "parse.h"
+#include "simd.h"
 
 #include <algorithm>
+#include <exception>
 #include <numeric>
 #include <iterator>
 #include <sstream>
 #include <iostream>
+#include <limits>
+#include <unordered_map>
 
-InvertedIndex::InvertedIndex(istream& document_input) {
-    for (string document; getline(document_input, document);) {
-        docs.push_back(move(document));
+const size_t MAX_RESULTS = 5;
+const size_t QUERY_BLOCK_SIZE = 256;
+const size_t MAX_PREFIX_TERMS = 64;
+const size_t MAX_BATCH_COUNTERS = 1 << 21;
 
-        const size_t docid = docs.size() - 1;
+deque<string> ReadDocuments(istream& document_input) {
+    deque<string> documents;
+    for (string document; getline(document_input, document);)
+        documents.push_back(move(document));
+    return documents;
+}
+
+InvertedIndex::InvertedIndex(istream& document_input) : InvertedIndex(ReadDocuments(document_input)) {
+}
 
-        for (string_view word: SplitIntoWords(docs.back())) {
+InvertedIndex::InvertedIndex(deque<string> documents) : docs(move(documents)) {
+    for (size_t docid = 0; docid < docs.size(); ++docid) {
+        for (string_view word: SplitIntoWords(docs[docid])) {
             auto& doc_hit = index[word];
 
             if (doc_hit.empty() || doc_hit.back().docid != docid)
@@ -25,71 +40,864 @@ InvertedIndex::InvertedIndex(istream& document_input) {
     }
 }
 
-const vector<InvertedIndex::DocHits>& InvertedIndex::Lookup(string_view word) const {
-    static const vector<DocHits> empty_result;
+size_t InvertedIndex::GetBuildWorkerCount(size_t document_count, size_t worker_count) {
+    return max<size_t>(1, min(worker_count, document_count / MIN_BUILD_DOCUMENTS_PER_WORKER));
+}
+
+InvertedIndex InvertedIndex::BuildFrozen(deque<string> documents, size_t worker_count) {
+    InvertedIndex result;
+    result.docs = move(documents);
+    const deque<string>& docs = result.docs;
+
+    worker_count = GetBuildWorkerCount(docs.size(), worker_count);
+    const size_t docs_per_worker = (docs.size() + worker_count - 1) / worker_count;
+
+    // Per worker and term: the document frequency in the worker's range after
+    // the first pass, then the worker's write position in the second.
+    struct TermSlot {
+        size_t rank = 0;
+        size_t position = 0;
+        size_t last_docid = numeric_limits<size_t>::max();
+    };
+    vector<unordered_map<string_view, TermSlot>> slots(worker_count);
+
+    auto run_workers = [&](auto work) {
+        vector<future<void>> workers;
+        for (size_t worker = 0; worker + 1 < worker_count; ++worker)
+            workers.push_back(async(launch::async, work, worker));
+        work(worker_count - 1);
+        for (auto& w : workers)
+            w.get();
+    };
+
+    run_workers([&](size_t worker) {
+        auto& worker_slots = slots[worker];
+        const size_t last = min(docs.size(), (worker + 1) * docs_per_worker);
+        for (size_t docid = worker * docs_per_worker; docid < last; ++docid) {
+            for (string_view word : SplitIntoWords(docs[docid])) {
+                TermSlot& slot = worker_slots[word];
+                if (slot.last_docid != docid) {
+                    slot.last_docid = docid;
+                    ++slot.position;
+                }
+            }
+        }
+    });
+
+    unordered_map<string_view, size_t> document_frequency;
+    for (const auto& worker_slots : slots) {
+        for (const auto& [word, slot] : worker_slots)
+            document_frequency[word] += slot.position;
+    }
+
+    vector<pair<string_view, size_t>> terms(document_frequency.begin(), document_frequency.end());
+    document_frequency.clear();
+    sort(terms.begin(), terms.end());
+
+    // Dense terms are staged in a scratch buffer and packed into bitmaps once
+    // all their postings are known; the rest go straight to their slots.
+    size_t pool_size = 0;
+    size_t posting_count = 0;
+    size_t dense_count = 0;
+    vector<size_t> next_position(terms.size());
+    vector<bool> dense(terms.size());
+    result.term_offsets.reserve(terms.size() + 1);
+    result.posting_offsets.reserve(terms.size() + 1);
+    for (size_t rank = 0; rank < terms.size(); ++rank) {
+        const auto& [word, frequency] = terms[rank];
+        result.term_offsets.push_back(pool_size);
+        result.posting_offsets.push_back(posting_count);
+        pool_size += word.size();
+
+        dense[rank] = result.IsDenseTerm(frequency);
+        if (dense[rank]) {
+            result.dense_ranks.push_back(rank);
+            next_position[rank] = dense_count;
+            dense_count += frequency;
+        } else {
+            next_position[rank] = posting_count;
+            posting_count += frequency;
+        }
+    }
+    result.term_offsets.push_back(pool_size);
+    result.posting_offsets.push_back(posting_count);
+
+    result.term_pool.reserve(pool_size);
+    for (const auto& [word, frequency] : terms)
+        result.term_pool.insert(result.term_pool.end(), word.begin(), word.end());
+
+    // Workers own consecutive docid ranges, so handing out each term's slot
+    // in worker order keeps every posting list sorted by docid.
+    unordered_map<string_view, size_t> ranks;
+    ranks.reserve(terms.size());
+    for (size_t rank = 0; rank < terms.size(); ++rank)
+        ranks.emplace(terms[rank].first, rank);
+    for (auto& worker_slots : slots) {
+        for (auto& [word, slot] : worker_slots) {
+            slot.rank = ranks[word];
+            const size_t frequency = slot.position;
+            slot.position = next_position[slot.rank];
+            slot.last_docid = numeric_limits<size_t>::max();
+            next_position[slot.rank] += frequency;
+        }
+    }
+    ranks.clear();
+
+    result.postings.resize(posting_count);
+    vector<DocHits> dense_scratch(dense_count);
+
+    run_workers([&](size_t worker) {
+        auto& worker_slots = slots[worker];
+        const size_t last = min(docs.size(), (worker + 1) * docs_per_worker);
+        for (size_t docid = worker * docs_per_worker; docid < last; ++docid) {
+            for (string_view word : SplitIntoWords(docs[docid])) {
+                TermSlot& slot = worker_slots.find(word)->second;
+                DocHits* target = dense[slot.rank] ? dense_scratch.data() : result.postings.data();
+                if (slot.last_docid != docid) {
+                    slot.last_docid = docid;
+                    target[slot.position++] = {docid, 1};
+                } else {
+                    target[slot.position - 1].hit_count++;
+                }
+            }
+        }
+    });
+    slots.clear();
+
+    result.dense_postings.resize(result.dense_ranks.size());
+    for (size_t i = 0, position = 0; i < result.dense_ranks.size(); ++i) {
+        const size_t last = position + terms[result.dense_ranks[i]].second;
+        result.dense_postings[i].Assign(dense_scratch.begin() + position, dense_scratch.begin() + last);
+        position = last;
+    }
+
+    result.eytzinger_terms.resize(terms.size() + 1);
+    result.eytzinger_ranks.resize(terms.size() + 1);
+    size_t rank = 0;
+    result.FillEytzinger(1, rank);
+
+    result.frozen = true;
+    return result;
+}
+
+InvertedIndex::Postings InvertedIndex::Lookup(string_view word) const {
+    if (frozen) {
+        const size_t rank = FindTermRank(word);
+        if (rank == term_offsets.size())
+            return {nullptr, nullptr};
+
+        return GetFrozenPostings(rank);
+    }
 
     auto it = index.find(word);
 
     if (it != index.end())
-        return it->second;
+        return {it->second.data(), it->second.data() + it->second.size()};
     else
-        return empty_result;
+        return {nullptr, nullptr};
+}
+
+template <typename Callback>
+void InvertedIndex::ForEachPrefixTerm(string_view prefix, size_t max_terms, Callback callback) const {
+    auto matches = [prefix](string_view word) {
+        return word.substr(0, prefix.size()) == prefix;
+    };
+
+    if (frozen) {
+        const size_t term_count = term_offsets.size() - 1;
+        size_t rank = 0;
+        for (size_t count = term_count; count > 0;) {
+            const size_t step = count / 2;
+            if (GetTerm(rank + step) < prefix) {
+                rank += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+
+        for (size_t found = 0; rank < term_count && found < max_terms && matches(GetTerm(rank)); ++rank, ++found)
+            callback(GetTerm(rank), GetFrozenPostings(rank));
+    } else {
+        size_t found = 0;
+        for (auto it = index.lower_bound(prefix); it != index.end() && found < max_terms && matches(it->first); ++it, ++found)
+            callback(it->first, Postings(it->second.data(), it->second.data() + it->second.size()));
+    }
+}
+
+vector<InvertedIndex::Postings> InvertedIndex::LookupPrefix(string_view prefix, size_t max_terms) const {
+    vector<Postings> result;
+    ForEachPrefixTerm(prefix, max_terms, [&result](string_view, Postings doc_hits) {
+        result.push_back(doc_hits);
+    });
+    return result;
+}
+
+vector<string_view> InvertedIndex::LookupPrefixTerms(string_view prefix, size_t max_terms) const {
+    vector<string_view> result;
+    ForEachPrefixTerm(prefix, max_terms, [&result](string_view word, Postings) {
+        result.push_back(word);
+    });
+    return result;
+}
+
+InvertedIndex::Postings InvertedIndex::GetFrozenPostings(size_t rank) const {
+    const DocHits* first = postings.data() + posting_offsets[rank];
+    const DocHits* last = postings.data() + posting_offsets[rank + 1];
+    if (first != last)
+        return {first, last};
+
+    // Only dense terms have an empty range in the packed postings.
+    auto it = lower_bound(dense_ranks.begin(), dense_ranks.end(), rank);
+    return Postings(&dense_postings[it - dense_ranks.begin()]);
+}
+
+bool InvertedIndex::IsDenseTerm(size_t document_frequency) const {
+    return document_frequency >= DENSE_TERM_MIN_COUNT && document_frequency * DENSE_TERM_RATIO >= docs.size();
+}
+
+string_view InvertedIndex::GetTerm(size_t rank) const {
+    return {term_pool.data() + term_offsets[rank], term_offsets[rank + 1] - term_offsets[rank]};
+}
+
+void InvertedIndex::FillEytzinger(size_t node, size_t& rank) {
+    if (node >= eytzinger_terms.size())
+        return;
+
+    FillEytzinger(2 * node, rank);
+    eytzinger_terms[node] = GetTerm(rank);
+    eytzinger_ranks[node] = rank++;
+    FillEytzinger(2 * node + 1, rank);
 }
 
-void UpdateDocumentBaseAsync(istream& document_input, Synchronized<InvertedIndex>& index) {
-    InvertedIndex new_index(document_input);
-    swap(index.GetAccess().ref_to_value, new_index);
+size_t InvertedIndex::FindTermRank(string_view word) const {
+    const size_t not_found = term_offsets.size();
+
+    size_t node = 1;
+    while (node < eytzinger_terms.size())
+        node = 2 * node + (eytzinger_terms[node] < word);
+
+    // Undo the trailing right turns to reach the lower_bound node.
+    while (node & 1)
+        node >>= 1;
+    node >>= 1;
+
+    if (node == 0 || eytzinger_terms[node] != word)
+        return not_found;
+    return eytzinger_ranks[node];
 }
 
-void AddQueriesStreamAsync(istream& query_input, ostream& search_results_output, Synchronized<InvertedIndex>& index) {
+void InvertedIndex::Freeze() {
+    if (frozen)
+        return;
+
+    size_t pool_size = 0;
+    size_t posting_count = 0;
+    for (const auto& [word, doc_hits] : index) {
+        pool_size += word.size();
+        posting_count += doc_hits.size();
+    }
+
+    term_pool.reserve(pool_size);
+    term_offsets.reserve(index.size() + 1);
+    postings.reserve(posting_count);
+    posting_offsets.reserve(index.size() + 1);
+
+    for (const auto& [word, doc_hits] : index) {
+        term_offsets.push_back(term_pool.size());
+        term_pool.insert(term_pool.end(), word.begin(), word.end());
+
+        posting_offsets.push_back(postings.size());
+
+        if (IsDenseTerm(doc_hits.size())) {
+            dense_ranks.push_back(term_offsets.size() - 1);
+            dense_postings.emplace_back().Assign(doc_hits.begin(), doc_hits.end());
+        } else {
+            postings.insert(postings.end(), doc_hits.begin(), doc_hits.end());
+        }
+    }
+    postings.shrink_to_fit();
+    term_offsets.push_back(term_pool.size());
+    posting_offsets.push_back(postings.size());
+
+    eytzinger_terms.resize(index.size() + 1);
+    eytzinger_ranks.resize(index.size() + 1);
+    size_t rank = 0;
+    FillEytzinger(1, rank);
+
+    index.clear();
+    frozen = true;
+}
+
+InvertedIndex::MemoryStats InvertedIndex::GetMemoryStats() const {
+    MemoryStats stats;
+
+    stats.dictionary_bytes = term_pool.capacity()
+            + term_offsets.capacity() * sizeof(size_t)
+            + posting_offsets.capacity() * sizeof(size_t)
+            + eytzinger_terms.capacity() * sizeof(string_view)
+            + eytzinger_ranks.capacity() * sizeof(size_t);
+    stats.dictionary_bytes += dense_ranks.capacity() * sizeof(size_t);
+    stats.postings_used_bytes = postings.size() * sizeof(DocHits);
+    stats.postings_reserved_bytes = postings.capacity() * sizeof(DocHits);
+    for (const auto& dense : dense_postings) {
+        stats.postings_used_bytes += sizeof(dense) + dense.GetUsedBytes();
+        stats.postings_reserved_bytes += sizeof(dense) + dense.GetReservedBytes();
+    }
+
+    for (const auto& [word, doc_hits] : index) {
+        stats.dictionary_bytes += sizeof(word) + sizeof(doc_hits);
+        stats.postings_used_bytes += doc_hits.size() * sizeof(DocHits);
+        stats.postings_reserved_bytes += doc_hits.capacity() * sizeof(DocHits);
+        stats.node_overhead_bytes += MAP_NODE_OVERHEAD;
+    }
+
+    for (const string& document : docs) {
+        stats.documents_bytes += sizeof(document);
+
+        const char* object_begin = reinterpret_cast<const char*>(&document);
+        const char* object_end = reinterpret_cast<const char*>(&document + 1);
+        if (document.data() < object_begin || document.data() >= object_end)
+            stats.documents_bytes += document.capacity() + 1;
+    }
+
+    return stats;
+}
+
+void InvertedIndex::ShrinkToFit() {
+    for (auto& [word, doc_hits] : index)
+        doc_hits.shrink_to_fit();
+}
+
+bool IsPrefixWord(string_view word) {
+    return word.size() > 1 && word.back() == '*';
+}
+
+// Terms every prefix word of a block expands to: the first MAX_PREFIX_TERMS
+// matching terms in dictionary order over the whole document base. Each shard
+// holds only part of the dictionary, so capping inside a shard would expand
+// a different set of terms in every shard.
+using PrefixExpansions = unordered_map<string_view, vector<string>>;
+
+void ExpandPrefixes(const ShardSet& shards, const vector<string_view>& queries, PrefixExpansions& expansions) {
+    expansions.clear();
+    for (string_view query : queries) {
+        for (string_view word : SplitIntoWords(query)) {
+            if (IsPrefixWord(word))
+                expansions[word];
+        }
+    }
+
+    if (expansions.empty())
+        return;
+
+    for (const auto& shard : shards) {
+        for (auto& [word, terms] : expansions) {
+            for (string_view term : shard->LookupPrefixTerms(word.substr(0, word.size() - 1), MAX_PREFIX_TERMS))
+                terms.emplace_back(term);
+        }
+    }
+
+    for (auto& [word, terms] : expansions) {
+        sort(terms.begin(), terms.end());
+        terms.erase(unique(terms.begin(), terms.end()), terms.end());
+        terms.resize(min(terms.size(), MAX_PREFIX_TERMS));
+    }
+}
+
+template <typename Callback, typename RunCallback, typename ShouldStop>
+bool ForEachHit(const InvertedIndex& index, string_view word, const PrefixExpansions& expansions,
+                Callback callback, RunCallback run_callback, ShouldStop should_stop) {
+    if (IsPrefixWord(word)) {
+        for (const string& term : expansions.at(word)) {
+            if (!index.Lookup(term).ForEachWithRuns(callback, run_callback, should_stop))
+                return false;
+        }
+        return true;
+    }
+
+    return index.Lookup(word).ForEachWithRuns(callback, run_callback, should_stop);
+}
+
+bool IsCancelled(const QueryOptions& options) {
+    return options.cancellation && options.cancellation->IsCancelled();
+}
+
+void SelectTopDocuments(const size_t* docid_count, size_t doc_count, size_t shard_index, size_t shard_count,
+                        vector<InvertedIndex::DocHits>& result) {
+    result.clear();
+
+    // Docids are scanned in ascending order, so a candidate only enters the top
+    // if it strictly beats the current last hit count; zero counts never do.
+    size_t threshold = 0;
+    const size_t* last = docid_count + doc_count;
+    for (const size_t* it = FindGreater(docid_count, last, threshold); it != last;
+         it = FindGreater(it + 1, last, threshold)) {
+        const InvertedIndex::DocHits candidate{static_cast<size_t>(it - docid_count), *it};
+
+        auto pos = find_if(result.begin(), result.end(), [&candidate](const InvertedIndex::DocHits& item) {
+            return item.hit_count < candidate.hit_count;
+        });
+        result.insert(pos, candidate);
+
+        if (result.size() > MAX_RESULTS)
+            result.pop_back();
+        if (result.size() == MAX_RESULTS)
+            threshold = result.back().hit_count;
+    }
+
+    for (auto& doc_hits : result)
+        doc_hits.docid = doc_hits.docid * shard_count + shard_index;
+}
+
+void SearchShard(const InvertedIndex& index, size_t shard_index, size_t shard_count,
+                 const vector<string_view>& queries, const PrefixExpansions& expansions, const QueryOptions& options,
+                 vector<SearchResult>& results) {
+    // Repeated queries in a block are evaluated once and copied afterwards.
+    unordered_map<string_view, size_t> first_occurrence;
+    vector<size_t> unique_queries;
+    for (size_t query_index = 0; query_index < queries.size(); ++query_index) {
+        if (first_occurrence.emplace(queries[query_index], query_index).second)
+            unique_queries.push_back(query_index);
+    }
+
     vector<size_t> docid_count;
-    vector<int64_t> docid_count_idx;
+    map<string_view, vector<size_t>> term_queries;
 
-    for (string current_query; getline(query_input, current_query);) {
-        {
-            auto access = index.GetAccess();
-            size_t doc_count = access.ref_to_value.GetDocumentCount();
-            docid_count.assign(doc_count, 0);
+    // Time each query of the batch has spent walking its own terms; a shared
+    // term is charged to every query that is still scanning it.
+    vector<chrono::steady_clock::duration> elapsed;
+    vector<size_t> active_queries;
+
+    for (size_t batch_begin = 0; batch_begin < unique_queries.size() && !IsCancelled(options);) {
+        const size_t doc_count = index.GetDocumentCount();
+        const size_t batch_size = max<size_t>(1, MAX_BATCH_COUNTERS / max<size_t>(doc_count, 1));
+        const size_t batch_end = min(unique_queries.size(), batch_begin + batch_size);
+
+        // Every posting list needed by the batch is walked once and its hits are
+        // scattered into the counters of all queries that contain the term.
+        term_queries.clear();
+        for (size_t i = batch_begin; i < batch_end; ++i) {
+            for (string_view word: SplitIntoWords(queries[unique_queries[i]])) {
+                term_queries[word].push_back(i - batch_begin);
+            }
+        }
+
+        for (size_t i = batch_begin; i < batch_end; ++i)
+            results[unique_queries[i]].truncated = false;
+        auto is_truncated = [&](size_t batch_query) -> bool& {
+            return results[unique_queries[batch_begin + batch_query]].truncated;
+        };
+
+        elapsed.assign(batch_end - batch_begin, {});
+        docid_count.assign((batch_end - batch_begin) * doc_count, 0);
+        for (const auto& [word, batch_queries] : term_queries) {
+            // Queries out of budget skip their remaining terms.
+            active_queries.clear();
+            for (size_t batch_query : batch_queries) {
+                if (!is_truncated(batch_query))
+                    active_queries.push_back(batch_query);
+            }
+            if (active_queries.empty())
+                continue;
 
-            for (string_view word: SplitIntoWords(current_query)) {
-                for (const auto& [docid, hit_count] : access.ref_to_value.Lookup(word)) {
-                    docid_count[docid] += hit_count;
+            // Before every posting block, queries whose budget ran out
+            // leave the scan; it stops once none is left.
+            const auto term_start = chrono::steady_clock::now();
+            auto should_stop = [&] {
+                if (IsCancelled(options))
+                    return true;
+                if (!options.query_budget)
+                    return false;
+
+                const auto spent = chrono::steady_clock::now() - term_start;
+                active_queries.erase(remove_if(active_queries.begin(), active_queries.end(), [&](size_t batch_query) {
+                    if (elapsed[batch_query] + spent < *options.query_budget)
+                        return false;
+                    is_truncated(batch_query) = true;
+                    return true;
+                }), active_queries.end());
+                return active_queries.empty();
+            };
+
+            const bool completed = ForEachHit(index, word, expansions, [&](size_t docid, size_t hit_count) {
+                for (size_t batch_query : active_queries) {
+                    docid_count[batch_query * doc_count + docid] += hit_count;
                 }
+            }, [&](size_t first_docid, const uint32_t* hit_counts, size_t count) {
+                for (size_t batch_query : active_queries)
+                    AddHitCounts(docid_count.data() + batch_query * doc_count + first_docid, hit_counts, count);
+            }, should_stop);
+
+            const auto spent = chrono::steady_clock::now() - term_start;
+            for (size_t batch_query : active_queries) {
+                elapsed[batch_query] += spent;
+                if (!completed)
+                    is_truncated(batch_query) = true;
             }
         }
 
-        docid_count_idx.resize(docid_count.size());
-        iota(docid_count_idx.begin(), docid_count_idx.end(), 0);
+        for (size_t i = batch_begin; i < batch_end; ++i) {
+            SelectTopDocuments(docid_count.data() + (i - batch_begin) * doc_count, doc_count,
+                               shard_index, shard_count, results[unique_queries[i]].documents);
+        }
 
+        batch_begin = batch_end;
+    }
+
+    for (size_t query_index = 0; query_index < queries.size(); ++query_index) {
+        const size_t first = first_occurrence[queries[query_index]];
+        if (first != query_index)
+            results[query_index] = results[first];
+    }
+}
+
+// Fills results in place, so the documents vectors keep their capacity.
+void MergeShardResults(const vector<vector<SearchResult>>& shard_results, vector<SearchResult>& results) {
+    results.resize(shard_results[0].size());
+
+    for (size_t query_index = 0; query_index < results.size(); ++query_index) {
+        auto& result = results[query_index];
+        result.documents.clear();
+        result.truncated = false;
+        for (const auto& shard_result : shard_results) {
+            const auto& documents = shard_result[query_index].documents;
+            result.documents.insert(result.documents.end(), documents.begin(), documents.end());
+            result.truncated = result.truncated || shard_result[query_index].truncated;
+        }
+
+        auto& documents = result.documents;
         partial_sort(
-                docid_count_idx.begin(),
-                Head(docid_count_idx, 5).end(),
-                docid_count_idx.end(),
-                [&docid_count](int64_t lhs, int64_t rhs) {
-                    return make_pair(docid_count[lhs], -lhs) > make_pair(docid_count[rhs], -rhs);
+                documents.begin(),
+                Head(documents, MAX_RESULTS).end(),
+                documents.end(),
+                [](const InvertedIndex::DocHits& lhs, const InvertedIndex::DocHits& rhs) {
+                    return make_pair(lhs.hit_count, rhs.docid) > make_pair(rhs.hit_count, lhs.docid);
                 }
         );
+        documents.resize(min(documents.size(), MAX_RESULTS));
+    }
+}
+
+// Scatters a block of queries to all shards and gathers the merged results;
+// returns false if the block was interrupted by cancellation. The block pins
+// one published shard set, so every query sees all shards at the same update.
+// A single shard is searched on the calling thread straight into results;
+// with more, every shard but the last gets its own thread.
+bool SearchBlock(const Synchronized<shared_ptr<const ShardSet>>& shard_set, const vector<string_view>& queries,
+                 const QueryOptions& options, vector<vector<SearchResult>>& shard_results,
+                 vector<SearchResult>& results) {
+    const shared_ptr<const ShardSet> pinned = shard_set.GetReadAccess().ref_to_value;
+    const ShardSet& shards = *pinned;
+    const size_t shard_count = shards.size();
+
+    PrefixExpansions expansions;
+    ExpandPrefixes(shards, queries, expansions);
+
+    if (shard_count == 1) {
+        results.resize(queries.size());
+        SearchShard(*shards[0], 0, 1, queries, expansions, options, results);
+        return !IsCancelled(options);
+    }
+
+    shard_results.resize(shard_count);
+    vector<future<void>> searches;
+    for (size_t shard_index = 0; shard_index < shard_count; ++shard_index) {
+        shard_results[shard_index].resize(queries.size());
+
+        if (shard_index + 1 < shard_count)
+            searches.push_back(async(launch::async, SearchShard, cref(*shards[shard_index]), shard_index,
+                                     shard_count, cref(queries), cref(expansions), cref(options),
+                                     ref(shard_results[shard_index])));
+        else
+            SearchShard(*shards[shard_index], shard_index, shard_count, queries, expansions, options,
+                        shard_results[shard_index]);
+    }
+    for (auto& search : searches)
+        search.get();
+
+    if (IsCancelled(options))
+        return false;
+
+    MergeShardResults(shard_results, results);
+    return true;
+}
+
+class QueryStreamProcessor {
+public:
+    QueryStreamProcessor(istream& query_input, ostream& search_results_output,
+                         const Synchronized<shared_ptr<const ShardSet>>& shards, QueryOptions options)
+        : query_input(query_input)
+        , search_results_output(search_results_output)
+        , shards(shards)
+        , options(options) {}
+
+    bool ProcessBlock() {
+        if (!query_input || IsCancelled(options))
+            return false;
 
-        search_results_output << current_query << ':';
-        for (auto docid : Head(docid_count_idx, 5)) {
-            size_t hit_count = docid_count[docid];
+        query_lines.clear();
+        for (string current_query; query_lines.size() < QUERY_BLOCK_SIZE && getline(query_input, current_query);)
+            query_lines.push_back(move(current_query));
 
-            if (hit_count == 0)
-                break;
+        if (query_lines.empty())
+            return false;
 
-            search_results_output << " {"
-                                  << "docid: " << docid << ", "
-                                  << "hitcount: " << hit_count << '}';
+        queries.assign(query_lines.begin(), query_lines.end());
+
+        // A block interrupted by cancellation may be incomplete, so it is dropped.
+        if (!SearchBlock(shards, queries, options, shard_results, results))
+            return false;
+
+        for (size_t query_index = 0; query_index < queries.size(); ++query_index) {
+            search_results_output << queries[query_index] << ':';
+            for (const auto& [docid, hit_count] : results[query_index].documents) {
+                search_results_output << " {"
+                                      << "docid: " << docid << ", "
+                                      << "hitcount: " << hit_count << '}';
+            }
+            if (results[query_index].truncated)
+                search_results_output << " [truncated]";
+
+            search_results_output << endl;
         }
 
-        search_results_output << endl;
+        return true;
     }
+
+private:
+    istream& query_input;
+    ostream& search_results_output;
+    const Synchronized<shared_ptr<const ShardSet>>& shards;
+    QueryOptions options;
+
+    vector<string> query_lines;
+    vector<string_view> queries;
+    vector<vector<SearchResult>> shard_results;
+    vector<SearchResult> results;
+};
+
+SearchServer::SearchServer(istream& document_input, size_t shard_count, size_t worker_count)
+    : shards(MakeShardSet(shard_count))
+    , scheduler(worker_count) {
+    logged_ticket = TakeUpdateTicket();
+    ApplyUpdate(ReadDocuments(document_input), false, logged_ticket);
+}
+
+SearchServer::SearchServer(const string& journal_directory, size_t shard_count, size_t worker_count)
+    : shards(MakeShardSet(shard_count))
+    , scheduler(worker_count)
+    , journal(make_unique<DocumentJournal>(journal_directory)) {
+    logged_ticket = TakeUpdateTicket();
+    ApplyUpdate(journal->TakeRecoveredDocuments(), false, logged_ticket);
 }
 
 void SearchServer::UpdateDocumentBase(istream& document_input) {
-    futures.push_back(async(UpdateDocumentBaseAsync, ref(document_input), ref(index)));
+    futures.push_back(async(&SearchServer::Update, this, ref(document_input), false, TakeUpdateTicket()));
+}
+
+void SearchServer::AddDocuments(istream& document_input) {
+    futures.push_back(async(&SearchServer::Update, this, ref(document_input), true, TakeUpdateTicket()));
+}
+
+void SearchServer::Checkpoint() {
+    if (journal)
+        journal->Checkpoint();
 }
 
-void SearchServer::AddQueriesStream(istream& query_input, ostream& search_results_output) {
-    futures.push_back(async(AddQueriesStreamAsync, ref(query_input), ref(search_results_output), ref(index)));
+shared_ptr<const ShardSet> SearchServer::MakeShardSet(size_t shard_count) {
+    return make_shared<const ShardSet>(max<size_t>(shard_count, 1), make_shared<const InvertedIndex>());
+}
+
+size_t SearchServer::GetShardCount() const {
+    return shards.GetReadAccess().ref_to_value->size();
+}
+
+uint64_t SearchServer::TakeUpdateTicket() {
+    lock_guard<mutex> guard(update_mutex);
+    return ++update_ticket;
+}
+
+// Tickets are taken in call order. Records are logged in ticket order, the
+// wait for the disk happens outside update_mutex so concurrent updates share a
+// group commit, and updates are then applied in ticket order as well. A failed
+// update still passes both turns on, so later updates are not stuck behind it.
+void SearchServer::Update(istream& document_input, bool append, uint64_t ticket) {
+    exception_ptr failure;
+    deque<string> documents;
+    try {
+        documents = ReadDocuments(document_input);
+    } catch (...) {
+        failure = current_exception();
+    }
+
+    uint64_t journal_ticket = 0;
+    {
+        unique_lock<mutex> lock(update_mutex);
+        update_cv.wait(lock, [this, ticket] { return logged_ticket + 1 == ticket; });
+        if (journal && !failure) {
+            try {
+                journal_ticket = append ? journal->LogAppend(documents) : journal->LogReset(documents);
+            } catch (...) {
+                failure = current_exception();
+            }
+        }
+        logged_ticket = ticket;
+        update_cv.notify_all();
+    }
+
+    if (journal && !failure) {
+        try {
+            journal->WaitDurable(journal_ticket);
+        } catch (...) {
+            failure = current_exception();
+        }
+    }
+
+    if (failure) {
+        // Appending nothing is a no-op that lets later updates proceed.
+        ApplyUpdate({}, true, ticket);
+        rethrow_exception(failure);
+    }
+
+    ApplyUpdate(move(documents), append, ticket);
+}
+
+// Shards are built without update_mutex, so later updates can be logged and
+// new tickets taken meanwhile. Only the turn is taken in ticket order: a reset
+// is built first and waits for its turn just to swap the shards in, an append
+// needs the documents left by the previous update and waits before building.
+void SearchServer::ApplyUpdate(deque<string> documents, bool append, uint64_t ticket) {
+    auto wait_for_turn = [this, ticket] {
+        unique_lock<mutex> lock(update_mutex);
+        update_cv.wait(lock, [this, ticket] { return applied_ticket + 1 == ticket; });
+        return document_count;
+    };
+
+    // Passes the turn on even if the update failed, so later updates do not
+    // wait for it forever.
+    auto finish = [this, ticket](optional<size_t> new_document_count) {
+        lock_guard<mutex> guard(update_mutex);
+        if (new_document_count)
+            document_count = *new_document_count;
+        applied_ticket = ticket;
+        update_cv.notify_all();
+    };
+
+    bool has_turn = false;
+    try {
+        const size_t shard_count = GetShardCount();
+        size_t first_docid = 0;
+        shared_ptr<const ShardSet> current;
+        if (append) {
+            first_docid = wait_for_turn();
+            has_turn = true;
+            current = shards.GetReadAccess().ref_to_value;
+        }
+
+        vector<deque<string>> shard_documents(shard_count);
+        vector<bool> changed(shard_count, !append);
+
+        // Appending rebuilds only the shards that receive documents, starting
+        // from a copy of the documents they already hold.
+        for (size_t docid = first_docid; docid < first_docid + documents.size(); ++docid) {
+            const size_t shard_index = docid % shard_count;
+            if (append && !changed[shard_index]) {
+                changed[shard_index] = true;
+                const InvertedIndex& index = *(*current)[shard_index];
+                for (size_t local_docid = 0; local_docid < index.GetDocumentCount(); ++local_docid)
+                    shard_documents[shard_index].push_back(index.GetDocument(local_docid));
+            }
+            shard_documents[shard_index].push_back(move(documents[docid - first_docid]));
+        }
+        const size_t new_document_count = first_docid + documents.size();
+
+        // Shards are rebuilt concurrently, so they split the cores between them.
+        const size_t changed_count = count(changed.begin(), changed.end(), true);
+        const size_t build_workers = max<size_t>(1, thread::hardware_concurrency() / max<size_t>(changed_count, 1));
+
+        size_t worker_count = 0;
+        for (size_t shard_index = 0; shard_index < shard_count; ++shard_index) {
+            if (changed[shard_index])
+                worker_count += InvertedIndex::GetBuildWorkerCount(shard_documents[shard_index].size(), build_workers);
+        }
+
+        vector<InvertedIndex> new_indexes(shard_count);
+        auto rebuild_shard = [&new_indexes, &shard_documents, build_workers](size_t shard_index) {
+            new_indexes[shard_index] = InvertedIndex::BuildFrozen(move(shard_documents[shard_index]), build_workers);
+        };
+
+        vector<future<void>> builds;
+        for (size_t shard_index = 0; shard_index < shard_count; ++shard_index) {
+            if (!changed[shard_index])
+                continue;
+
+            if (shard_index + 1 < shard_count)
+                builds.push_back(async(launch::async, rebuild_shard, shard_index));
+            else
+                rebuild_shard(shard_index);
+        }
+
+        for (auto& build : builds)
+            build.get();
+
+        if (!has_turn) {
+            wait_for_turn();
+            has_turn = true;
+        }
+
+        // All rebuilt shards are published in one pointer swap; the old set
+        // lives on until the query blocks that pinned it are done.
+        if (!current)
+            current = shards.GetReadAccess().ref_to_value;
+        auto next = make_shared<ShardSet>(*current);
+        for (size_t shard_index = 0; shard_index < shard_count; ++shard_index) {
+            if (changed[shard_index])
+                (*next)[shard_index] = make_shared<const InvertedIndex>(move(new_indexes[shard_index]));
+        }
+        shared_ptr<const ShardSet> published = move(next);
+        swap(shards.GetAccess().ref_to_value, published);
+        build_worker_count = worker_count;
+
+        finish(new_document_count);
+    } catch (...) {
+        if (!has_turn)
+            wait_for_turn();
+        finish(nullopt);
+        throw;
+    }
+}
+
+void SearchServer::AddQueriesStream(istream& query_input, ostream& search_results_output, QueryOptions options) {
+    auto processor = make_shared<QueryStreamProcessor>(query_input, search_results_output, shards, options);
+    futures.push_back(scheduler.AddStream([processor] {
+        return processor->ProcessBlock();
+    }, options.weight, options.stats));
+}
+
+bool SearchServer::Search(const vector<string_view>& queries, vector<SearchResult>& results,
+                          const QueryOptions& options) {
+    vector<vector<SearchResult>> shard_results;
+    return SearchBlock(shards, queries, options, shard_results, results);
+}
+
+bool SearchServer::Search(string_view query_buffer, vector<SearchResult>& results, const QueryOptions& options) {
+    return Search(SplitBy(query_buffer, '\n'), results, options);
+}
+
+void SearchServer::Wait() {
+    // Everything is waited for before the first failure is rethrown.
+    exception_ptr failure;
+    for (auto& f : futures) {
+        try {
+            f.get();
+        } catch (...) {
+            if (!failure)
+                failure = current_exception();
+        }
+    }
+    futures.clear();
+
+    if (failure)
+        rethrow_exception(failure);
 }
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "sinchronized.h"
+#include "iterator_range.h"
+#include "bitmap_postings.h"
+#include "query_scheduler.h"
+#include "document_journal.h"
 
 #include <istream>
 #include <ostream>
@@ -11,6 +15,12 @@
 #include <map>
 #include <string>
 #include <future>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
@@ -21,11 +31,95 @@ public:
         size_t hit_count;
     };
 
+    struct MemoryStats {
+        size_t dictionary_bytes = 0;
+        size_t postings_used_bytes = 0;
+        size_t postings_reserved_bytes = 0;
+        size_t documents_bytes = 0;
+        size_t node_overhead_bytes = 0;
+
+        size_t Total() const {
+            return dictionary_bytes + postings_reserved_bytes + documents_bytes + node_overhead_bytes;
+        }
+    };
+
+    class Postings {
+    public:
+        Postings() = default;
+
+        Postings(const DocHits* first, const DocHits* last) : first(first), last(last) {}
+
+        explicit Postings(const BitmapPostings* dense) : dense(dense) {}
+
+        size_t size() const {
+            return dense ? dense->size() : last - first;
+        }
+
+        template <typename Callback>
+        void ForEach(Callback callback) const {
+            ForEach(callback, [] { return false; });
+        }
+
+        // Calls should_stop before every block of postings; returns false if it stopped early.
+        template <typename Callback, typename ShouldStop>
+        bool ForEach(Callback callback, ShouldStop should_stop) const {
+            if (dense)
+                return dense->ForEach(callback, should_stop);
+
+            for (const DocHits* it = first; it != last;) {
+                if (should_stop())
+                    return false;
+
+                const DocHits* block_end = it + min<size_t>(BLOCK_SIZE, last - it);
+                for (; it != block_end; ++it)
+                    callback(it->docid, it->hit_count);
+            }
+
+            return true;
+        }
+
+        // Same, but runs of consecutive docids stored in bitmap postings go to
+        // run_callback(first_docid, hit_counts, count) at once.
+        template <typename Callback, typename RunCallback, typename ShouldStop>
+        bool ForEachWithRuns(Callback callback, RunCallback run_callback, ShouldStop should_stop) const {
+            if (dense)
+                return dense->ForEachWithRuns(callback, run_callback, should_stop);
+            return ForEach(callback, should_stop);
+        }
+
+    private:
+        static constexpr size_t BLOCK_SIZE = 1024;
+
+        const DocHits* first = nullptr;
+        const DocHits* last = nullptr;
+        const BitmapPostings* dense = nullptr;
+    };
+
     InvertedIndex() = default;
 
     explicit InvertedIndex(istream& document_input);
 
-    const vector<InvertedIndex::DocHits>& Lookup(string_view word) const;
+    explicit InvertedIndex(deque<string> documents);
+
+    // Builds the frozen layout directly in two passes: the first counts the
+    // document frequency of every term, the second writes postings into
+    // exactly sized slots of one buffer. Both passes split the documents
+    // between worker_count threads.
+    static InvertedIndex BuildFrozen(deque<string> documents, size_t worker_count = 1);
+
+    // Every BuildFrozen worker gets at least MIN_BUILD_DOCUMENTS_PER_WORKER
+    // documents; this is how many of worker_count it actually starts.
+    static size_t GetBuildWorkerCount(size_t document_count, size_t worker_count);
+
+    static const size_t MIN_BUILD_DOCUMENTS_PER_WORKER = 4096;
+
+    Postings Lookup(string_view word) const;
+
+    // Posting lists of at most max_terms terms starting with prefix, in dictionary order.
+    vector<Postings> LookupPrefix(string_view prefix, size_t max_terms) const;
+
+    // The terms themselves, valid as long as the index is not modified.
+    vector<string_view> LookupPrefixTerms(string_view prefix, size_t max_terms) const;
 
     const string& GetDocument(size_t id) const {
         return docs[id];
@@ -35,22 +129,146 @@ public:
         return docs.size();
     }
 
+    MemoryStats GetMemoryStats() const;
+
+    void ShrinkToFit();
+
+    // Replaces the map with sorted contiguous term and posting arrays searched
+    // in Eytzinger order; the index must not be modified afterwards. Terms found
+    // in at least 1/DENSE_TERM_RATIO of the documents get bitmap postings.
+    void Freeze();
+
+    bool IsFrozen() const {
+        return frozen;
+    }
+
 private:
+    // Red-black tree node header in libstdc++/libc++: color plus three links.
+    static const size_t MAP_NODE_OVERHEAD = 4 * sizeof(void*);
+    static const size_t DENSE_TERM_RATIO = 16;
+    static const size_t DENSE_TERM_MIN_COUNT = 1024;
+
     map<string_view, vector<DocHits>> index;
     deque<string> docs;
+
+    bool frozen = false;
+    vector<char> term_pool;
+    vector<size_t> term_offsets;
+    vector<DocHits> postings;
+    vector<size_t> posting_offsets;
+    vector<string_view> eytzinger_terms;
+    vector<size_t> eytzinger_ranks;
+    vector<size_t> dense_ranks;
+    vector<BitmapPostings> dense_postings;
+
+    bool IsDenseTerm(size_t document_frequency) const;
+    string_view GetTerm(size_t rank) const;
+    Postings GetFrozenPostings(size_t rank) const;
+    void FillEytzinger(size_t node, size_t& rank);
+    size_t FindTermRank(string_view word) const;
+
+    template <typename Callback>
+    void ForEachPrefixTerm(string_view prefix, size_t max_terms, Callback callback) const;
+};
+
+class CancellationToken {
+public:
+    void Cancel() {
+        cancelled = true;
+    }
+
+    bool IsCancelled() const {
+        return cancelled;
+    }
+
+private:
+    atomic<bool> cancelled = false;
+};
+
+struct QueryOptions {
+    // Time a query may spend walking its own terms, counted per query even
+    // when queries share posting scans. When it runs out the query leaves the
+    // scan at the next posting block, skips its remaining terms and returns
+    // its best partial top as truncated; the other queries go on.
+    optional<chrono::steady_clock::duration> query_budget;
+
+    // Cancels the whole stream; the output then holds only complete blocks.
+    const CancellationToken* cancellation = nullptr;
+
+    // Blocks of 256 queries the stream may run per scheduling turn.
+    size_t weight = 1;
+
+    // Filled with the stream's queueing statistics once it completes.
+    StreamStats* stats = nullptr;
+};
+
+// Indexes of all shards as of one update. A new set is published as a whole,
+// so a query block that pins one sees every shard at the same version.
+using ShardSet = vector<shared_ptr<const InvertedIndex>>;
+
+struct SearchResult {
+    vector<InvertedIndex::DocHits> documents;
+    bool truncated = false;
 };
 
 class SearchServer {
 public:
     SearchServer() = default;
 
-    explicit SearchServer(istream& document_input) : index(InvertedIndex(document_input)) {}
+    // worker_count query streams are processed at once; 0 means one per hardware thread.
+    explicit SearchServer(istream& document_input, size_t shard_count = 1, size_t worker_count = 0);
+
+    // Keeps the document base durable in journal_directory and recovers it from
+    // there on construction; updates return only after they are logged.
+    explicit SearchServer(const string& journal_directory, size_t shard_count = 1, size_t worker_count = 0);
 
     void UpdateDocumentBase(istream& document_input);
 
-    void AddQueriesStream(istream& query_input, ostream& search_results_output);
+    // Appends documents after the current ones, continuing the docid sequence.
+    void AddDocuments(istream& document_input);
+
+    // Compacts the journal into its snapshot; a no-op without a journal.
+    void Checkpoint();
+
+    void AddQueriesStream(istream& query_input, ostream& search_results_output, QueryOptions options = {});
+
+    // Evaluates queries outside the stream scheduler; results[i] receives the
+    // top documents of queries[i], written in place so a reused buffer keeps
+    // its allocations. With one shard everything runs on the calling thread;
+    // with more, the other shards are searched on threads of their own, as for
+    // query streams. Returns false if the call was cancelled, leaving results
+    // unspecified.
+    bool Search(const vector<string_view>& queries, vector<SearchResult>& results, const QueryOptions& options = {});
+
+    // Same for '\n'-separated queries in one contiguous buffer.
+    bool Search(string_view query_buffer, vector<SearchResult>& results, const QueryOptions& options = {});
+
+    void Wait();
+
+    size_t GetShardCount() const;
+
+    // Threads the last rebuild of the document base used across all shards.
+    size_t GetBuildWorkerCount() const {
+        return build_worker_count;
+    }
 
 private:
-    Synchronized<InvertedIndex> index;
+    Synchronized<shared_ptr<const ShardSet>> shards{MakeShardSet(1)};
+    QueryScheduler scheduler;
+    unique_ptr<DocumentJournal> journal;
+
+    mutex update_mutex;
+    condition_variable update_cv;
+    uint64_t update_ticket = 0;
+    uint64_t logged_ticket = 0;
+    uint64_t applied_ticket = 0;
+    size_t document_count = 0;
+    atomic<size_t> build_worker_count = 0;
+
     vector<future<void>> futures;
+
+    static shared_ptr<const ShardSet> MakeShardSet(size_t shard_count);
+    uint64_t TakeUpdateTicket();
+    void Update(istream& document_input, bool append, uint64_t ticket);
+    void ApplyUpdate(deque<string> documents, bool append, uint64_t ticket);
 };
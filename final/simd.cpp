@@ -0,0 +1,85 @@
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+const size_t* FindGreaterScalar(const size_t* first, const size_t* last, size_t threshold) {
+    while (first != last && *first <= threshold)
+        ++first;
+    return first;
+}
+
+void AddHitCountsScalar(size_t* counters, const uint32_t* hit_counts, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        counters[i] += hit_counts[i];
+}
+
+#ifdef SIMD_HAVE_AVX2
+// Counts stay far below 2^63, so the signed 64-bit compare is exact.
+__attribute__((target("avx2")))
+const size_t* FindGreaterAvx2(const size_t* first, const size_t* last, size_t threshold) {
+    const __m256i limit = _mm256_set1_epi64x(static_cast<long long>(threshold));
+
+    for (; last - first >= 8; first += 8) {
+        const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+        const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first + 4));
+        const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(lo, limit)))
+                | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(hi, limit))) << 4;
+
+        if (mask != 0)
+            return first + __builtin_ctz(mask);
+    }
+
+    return FindGreaterScalar(first, last, threshold);
+}
+
+// Widens four hit counts at a time to 64 bits and adds them to the counters.
+__attribute__((target("avx2")))
+void AddHitCountsAvx2(size_t* counters, const uint32_t* hit_counts, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i lo = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hit_counts + i)));
+        const __m256i hi = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hit_counts + i + 4)));
+        __m256i* target = reinterpret_cast<__m256i*>(counters + i);
+        _mm256_storeu_si256(target, _mm256_add_epi64(_mm256_loadu_si256(target), lo));
+        _mm256_storeu_si256(target + 1, _mm256_add_epi64(_mm256_loadu_si256(target + 1), hi));
+    }
+
+    AddHitCountsScalar(counters + i, hit_counts + i, count - i);
+}
+#endif
+
+struct SimdDispatch {
+    FindGreaterFunc find_greater = FindGreaterScalar;
+    AddHitCountsFunc add_hit_counts = AddHitCountsScalar;
+    const char* level = "scalar";
+
+    SimdDispatch() {
+#ifdef SIMD_HAVE_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            find_greater = FindGreaterAvx2;
+            add_hit_counts = AddHitCountsAvx2;
+            level = "avx2";
+        }
+#endif
+    }
+};
+
+const SimdDispatch& GetDispatch() {
+    static const SimdDispatch dispatch;
+    return dispatch;
+}
+
+const size_t* FindGreater(const size_t* first, const size_t* last, size_t threshold) {
+    return GetDispatch().find_greater(first, last, threshold);
+}
+
+void AddHitCounts(size_t* counters, const uint32_t* hit_counts, size_t count) {
+    GetDispatch().add_hit_counts(counters, hit_counts, count);
+}
+
+const char* GetSimdLevel() {
+    return GetDispatch().level;
+}
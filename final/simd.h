@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+using FindGreaterFunc = const size_t* (*)(const size_t*, const size_t*, size_t);
+
+// First element of [first, last) strictly greater than threshold, or last.
+const size_t* FindGreaterScalar(const size_t* first, const size_t* last, size_t threshold);
+
+// Same as FindGreaterScalar, dispatched at startup to the widest kernel the CPU supports.
+const size_t* FindGreater(const size_t* first, const size_t* last, size_t threshold);
+
+using AddHitCountsFunc = void (*)(size_t*, const uint32_t*, size_t);
+
+// counters[i] += hit_counts[i] for every i in [0, count).
+void AddHitCountsScalar(size_t* counters, const uint32_t* hit_counts, size_t count);
+
+// Same as AddHitCountsScalar, dispatched like FindGreater.
+void AddHitCounts(size_t* counters, const uint32_t* hit_counts, size_t count);
+
+const char* GetSimdLevel();
@@ -1,9 +1,44 @@
 #pragma once
 
+#include <atomic>
 #include <mutex>
+#include <shared_mutex>
 
 using namespace std;
 
+// shared_mutex that does not let a stream of readers starve writers: once a
+// writer is waiting, new readers queue up behind it on the gate.
+class WriterPreferringMutex {
+public:
+    void lock() {
+        ++waiting_writers;
+        lock_guard<mutex> gate_guard(gate);
+        shared.lock();
+        --waiting_writers;
+    }
+
+    void unlock() {
+        shared.unlock();
+    }
+
+    void lock_shared() {
+        if (waiting_writers > 0) {
+            gate.lock();
+            gate.unlock();
+        }
+        shared.lock_shared();
+    }
+
+    void unlock_shared() {
+        shared.unlock_shared();
+    }
+
+private:
+    shared_mutex shared;
+    mutex gate;
+    atomic<size_t> waiting_writers = 0;
+};
+
 template <typename T>
 class Synchronized {
 public:
@@ -11,14 +46,23 @@ public:
 
     struct Access {
         T& ref_to_value;
-        lock_guard<mutex> guard;
+        unique_lock<WriterPreferringMutex> guard;
+    };
+
+    struct ReadAccess {
+        const T& ref_to_value;
+        shared_lock<WriterPreferringMutex> guard;
     };
 
     Access GetAccess() {
-        return {value, lock_guard(m)};
+        return {value, unique_lock(m)};
+    }
+
+    ReadAccess GetReadAccess() const {
+        return {value, shared_lock(m)};
     }
 
 private:
     T value;
-    mutex m;
+    mutable WriterPreferringMutex m;
 };
@@ -1,11 +1,15 @@
 #include "test_runner.h"
 
 #include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <queue>
 #include <stdexcept>
 #include <set>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
@@ -66,6 +70,176 @@ private:
     set<T*> allocated_;
 };
 
+// Small index of the calling thread, handed to the next thread once it exits.
+inline size_t ThreadSlot() {
+    static mutex slots_mutex;
+    static vector<size_t> free_slots;
+    static size_t slot_count = 0;
+
+    struct Slot {
+        size_t index;
+
+        Slot() {
+            lock_guard<mutex> guard(slots_mutex);
+            if (!free_slots.empty()) {
+                index = free_slots.back();
+                free_slots.pop_back();
+            }
+            else {
+                index = slot_count++;
+            }
+        }
+
+        ~Slot() {
+            lock_guard<mutex> guard(slots_mutex);
+            free_slots.push_back(index);
+        }
+    };
+
+    thread_local Slot slot;
+    return slot.index;
+}
+
+// ObjectPool that any number of threads may share. Every thread keeps free
+// objects in its own cache, so Allocate and Deallocate are a few pointer moves
+// without atomics. A cache that grows to twice BATCH_SIZE hands its oldest
+// BATCH_SIZE objects to a lock-free stack of batches with one CAS; an empty
+// cache takes the whole stack with one exchange and uses it batch by batch.
+// Taking everything at once is what keeps the stack free of ABA.
+//
+// An object may be deallocated by any thread. Objects sitting in another
+// thread's cache are not visible to TryAllocate, and Allocate creates a new
+// one instead. Deallocate detects double and foreign-pool deallocation, but
+// the pointer must come from some ConcurrentObjectPool<T>.
+template <class T>
+class ConcurrentObjectPool {
+public:
+    ConcurrentObjectPool() = default;
+    ConcurrentObjectPool(const ConcurrentObjectPool&) = delete;
+    ConcurrentObjectPool& operator=(const ConcurrentObjectPool&) = delete;
+
+    // Objects move between a thread cache and the shared stack this many at a time.
+    static constexpr size_t BATCH_SIZE = 32;
+
+    T* Allocate() {
+        if (T* object = TryAllocate())
+            return object;
+
+        Node* node = new Node();
+        node->owner = this;
+        node->in_use.store(true, memory_order_relaxed);
+        node->next_created = created_.load(memory_order_relaxed);
+        while (!created_.compare_exchange_weak(node->next_created, node, memory_order_release, memory_order_relaxed)) {
+        }
+
+        return &node->object;
+    }
+
+    T* TryAllocate() {
+        const size_t slot = ThreadSlot();
+        if (slot < MAX_CACHED_THREADS)
+            return PopCached(caches_[slot]);
+
+        lock_guard<mutex> guard(overflow_mutex_);
+        return PopCached(overflow_cache_);
+    }
+
+    void Deallocate(T* object) {
+        Node* node = reinterpret_cast<Node*>(object);
+        // The exchange lets only one of two racing deallocations through.
+        if (node->owner != this || !node->in_use.exchange(false, memory_order_relaxed))
+            throw invalid_argument("Wrong deallocate of object");
+
+        const size_t slot = ThreadSlot();
+        if (slot < MAX_CACHED_THREADS) {
+            PushCached(caches_[slot], node);
+            return;
+        }
+
+        lock_guard<mutex> guard(overflow_mutex_);
+        PushCached(overflow_cache_, node);
+    }
+
+    ~ConcurrentObjectPool() {
+        for (Node* node = created_.load(memory_order_acquire); node;) {
+            Node* next = node->next_created;
+            delete node;
+            node = next;
+        }
+    }
+
+private:
+    // Threads beyond this share one cache behind a mutex.
+    static const size_t MAX_CACHED_THREADS = 64;
+
+    struct Node {
+        // First member, so that a T* handed out is also a Node*.
+        T object;
+        ConcurrentObjectPool* owner = nullptr;
+        atomic<bool> in_use = false;
+        Node* next = nullptr;
+        // Set on the first node of a batch.
+        Node* next_batch = nullptr;
+        size_t batch_size = 0;
+        // Every node ever created, for the destructor.
+        Node* next_created = nullptr;
+    };
+
+    struct alignas(64) Cache {
+        Node* head = nullptr;
+        size_t size = 0;
+        // Batches taken from the shared stack and not used yet.
+        Node* spare_batches = nullptr;
+    };
+
+    Cache caches_[MAX_CACHED_THREADS];
+    mutex overflow_mutex_;
+    Cache overflow_cache_;
+
+    alignas(64) atomic<Node*> free_batches_ = nullptr;
+    alignas(64) atomic<Node*> created_ = nullptr;
+
+    T* PopCached(Cache& cache) {
+        if (!cache.head) {
+            if (!cache.spare_batches)
+                cache.spare_batches = free_batches_.exchange(nullptr, memory_order_acquire);
+            if (!cache.spare_batches)
+                return nullptr;
+
+            cache.head = cache.spare_batches;
+            cache.size = cache.head->batch_size;
+            cache.spare_batches = cache.head->next_batch;
+        }
+
+        Node* node = cache.head;
+        cache.head = node->next;
+        --cache.size;
+
+        node->in_use.store(true, memory_order_relaxed);
+        return &node->object;
+    }
+
+    void PushCached(Cache& cache, Node* node) {
+        node->next = cache.head;
+        cache.head = node;
+        if (++cache.size < 2 * BATCH_SIZE)
+            return;
+
+        Node* last_kept = cache.head;
+        for (size_t i = 1; i < BATCH_SIZE; ++i)
+            last_kept = last_kept->next;
+
+        Node* batch = last_kept->next;
+        last_kept->next = nullptr;
+        cache.size = BATCH_SIZE;
+
+        batch->batch_size = BATCH_SIZE;
+        batch->next_batch = free_batches_.load(memory_order_relaxed);
+        while (!free_batches_.compare_exchange_weak(batch->next_batch, batch, memory_order_release, memory_order_relaxed)) {
+        }
+    }
+};
+
 void TestObjectPool() {
     ObjectPool<string> pool;
 
@@ -88,8 +262,139 @@ void TestObjectPool() {
     pool.Deallocate(p1);
 }
 
+void TestConcurrentObjectPool() {
+    ConcurrentObjectPool<string> pool;
+    ASSERT(pool.TryAllocate() == nullptr);
+
+    auto p1 = pool.Allocate();
+    auto p2 = pool.Allocate();
+    ASSERT(p1 != p2);
+
+    *p1 = "first";
+    pool.Deallocate(p1);
+    auto p3 = pool.TryAllocate();
+    ASSERT(p3 == p1);
+    ASSERT_EQUAL(*p3, "first");
+    ASSERT(pool.TryAllocate() == nullptr);
+
+    pool.Deallocate(p2);
+    try {
+        pool.Deallocate(p2);
+        ASSERT(false);
+    }
+    catch (invalid_argument&) {
+    }
+
+    ConcurrentObjectPool<string> other;
+    try {
+        other.Deallocate(p3);
+        ASSERT(false);
+    }
+    catch (invalid_argument&) {
+    }
+    pool.Deallocate(p3);
+}
+
+void TestConcurrentObjectPoolCrossThread() {
+    const size_t OBJECT_COUNT = 1000;
+    ConcurrentObjectPool<int> pool;
+
+    vector<int*> objects;
+    for (size_t i = 0; i < OBJECT_COUNT; ++i)
+        objects.push_back(pool.Allocate());
+
+    thread([&] {
+        for (int* object : objects)
+            pool.Deallocate(object);
+    }).join();
+
+    // All but the other thread's cache came back through the shared stack.
+    set<int*> returned(objects.begin(), objects.end());
+    size_t reused = 0;
+    while (int* object = pool.TryAllocate()) {
+        ASSERT(returned.count(object) == 1);
+        ++reused;
+    }
+    ASSERT(reused + 2 * ConcurrentObjectPool<int>::BATCH_SIZE >= OBJECT_COUNT);
+}
+
+// Two threads deallocating the same object at once: exactly one is rejected.
+void TestConcurrentObjectPoolDoubleDeallocate() {
+    ConcurrentObjectPool<int> pool;
+    for (size_t round = 0; round < 1000; ++round) {
+        int* object = pool.Allocate();
+        atomic<size_t> ready = 0;
+        atomic<size_t> rejected = 0;
+        auto deallocate = [&] {
+            for (++ready; ready < 2;)
+                this_thread::yield();
+            try {
+                pool.Deallocate(object);
+            }
+            catch (invalid_argument&) {
+                ++rejected;
+            }
+        };
+
+        thread first(deallocate);
+        thread second(deallocate);
+        first.join();
+        second.join();
+        ASSERT_EQUAL(rejected.load(), 1u);
+    }
+}
+
+void TestConcurrentObjectPoolStress() {
+    const size_t THREAD_COUNT = 4;
+    const size_t ITERATIONS = 100000;
+    ConcurrentObjectPool<size_t> pool;
+
+    // Objects pass through a shared hand-off list, so most of them are
+    // deallocated by a thread other than the one that allocated them.
+    mutex handoff_mutex;
+    vector<size_t*> handoff;
+    atomic<bool> failed = false;
+
+    vector<thread> threads;
+    for (size_t thread_index = 0; thread_index < THREAD_COUNT; ++thread_index) {
+        threads.emplace_back([&, thread_index] {
+            vector<size_t*> held;
+            for (size_t i = 0; i < ITERATIONS; ++i) {
+                size_t* object = pool.Allocate();
+                *object = thread_index * ITERATIONS + i;
+                held.push_back(object);
+
+                if (held.size() == 16) {
+                    for (size_t j = 0; j < held.size(); ++j) {
+                        if (*held[j] != thread_index * ITERATIONS + i - held.size() + 1 + j)
+                            failed = true;
+                    }
+
+                    lock_guard<mutex> guard(handoff_mutex);
+                    swap(held, handoff);
+                }
+                if (held.size() == 16) {
+                    for (size_t* handed : held)
+                        pool.Deallocate(handed);
+                    held.clear();
+                }
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    ASSERT(!failed);
+    for (size_t* object : handoff)
+        pool.Deallocate(object);
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestObjectPool);
+    RUN_TEST(tr, TestConcurrentObjectPool);
+    RUN_TEST(tr, TestConcurrentObjectPoolCrossThread);
+    RUN_TEST(tr, TestConcurrentObjectPoolDoubleDeallocate);
+    RUN_TEST(tr, TestConcurrentObjectPoolStress);
     return 0;
 }
\ No newline at end of file